@@ -1,52 +1,365 @@
-// Create LaTeX source code for single-digit arithmetic tests. Output is stored
-// in a '.tex' file which the user processes separately.
+// Create packets of arithmetic tests (addition, multiplication, subtraction,
+// division or a mix of them, with operands from given ranges) as LaTeX source
+// to be processed separately, or as PDF. Packets are created one per run, for
+// every line of a batch manifest (or a shard of it), or on request over a Unix
+// socket. This is the command line program; the packets themselves are
+// created by PacketGenerator (see packet_generator.h).
+
+#include "packet_generator.h"
+#include "packet_generator_internal.h"
 
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <sstream>
 #include <string>
-#include <algorithm>
-#include <utility>
-#include <math.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <getopt.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <zlib.h>
+
+using packet_generator::AnswerKeyFormat;
+using packet_generator::CheckRanges;
+using packet_generator::FingerprintSet;
+using packet_generator::OperandRange;
+using packet_generator::Operation;
+using packet_generator::OperationWeight;
+using packet_generator::OutputBuffer;
+using packet_generator::OutputOptions;
+using packet_generator::PacketGenerator;
+using packet_generator::PacketIdHash;
+using packet_generator::PacketRequest;
+using packet_generator::PacketSeed;
+using packet_generator::ParseRanges;
+using packet_generator::ParseTestSelection;
+using packet_generator::ParseTestType;
+using packet_generator::PoolSize;
+using packet_generator::ProblemResults;
+using packet_generator::RandomSeed;
+using packet_generator::ScopedTimer;
+using packet_generator::Stats;
+using packet_generator::kAddition;
+using packet_generator::kBinaryAnswerKey;
+using packet_generator::kCsvAnswerKey;
+using packet_generator::kLatexOutput;
+using packet_generator::kMaxMixWeight;
+using packet_generator::kMaxOperand;
+using packet_generator::kNoAnswerKey;
+using packet_generator::kPdfOutput;
+using packet_generator::stats;
+
+// Output file name which stands for the standard output
+const char* const kStandardOutput = "-";
+
+// Long-only options (values outside of the range of the short option chars)
+const int kBufferSizeOption = 256;
+const int kPipeOption = 257;
+const int kStatsOption = 259;
+const int kNoRepeatOption = 260;
+const int kAnswerKeyOption = 261;
+const int kMmapOption = 262;
+const int kCacheDirOption = 263;
+const int kServerOption = 264;
+const int kUniqueOption = 265;
+const int kUniqueStoreOption = 266;
+const int kResultsOption = 267;
+const int kGzipOption = 268;
+const int kTestsOption = 270;
+const int kShardOption = 271;
+
+// Most problems a server request may ask for (the selected tests times the
+// problems per test), which bounds the size of a reply to some tens of MB
+const size_t kMaxServerProblems = 1000000;
+
+// Seconds a server client may take no data before its reply is dropped
+const int kServerSendTimeout = 30;
+
+// Worker threads which answer server requests; they mostly wait for clients to
+// take the data, so there are more of them than cores, and each one holds a
+// buffer of --buffer-size bytes while it answers a request
+const int kServerWorkers = 32;
+
+// Complete requests which may wait for a worker; clients beyond that are told
+// that the server is busy (503) right away, instead of waiting without bound
+const size_t kMaxQueuedRequests = 128;
+
+// Stream buffer which compresses everything written to it into gzip format on
+// the way to another stream, e.g. between an OutputBuffer and its file:
+//
+//   GzipStreamBuffer gzip(file_out);
+//   std::ostream gzip_out(&gzip);
+//   OutputBuffer output(gzip_out, block_size);
+//   ... output.Flush(); gzip.Finish() ...
+//
+// The data is compressed by a worker thread of its own. Writes are collected
+// into blocks which are queued for the worker (up to kMaxQueuedBlocks at a
+// time), so that compression overlaps with creating the packet, and the blocks
+// are reused once compressed. Flushing the stream passes on everything written
+// so far (as a deflate sync point), so streaming output stays streaming.
+class GzipStreamBuffer : public std::streambuf {
+ public:
+  static const size_t kBlockSize = 1 << 20;
+  static const size_t kMaxQueuedBlocks = 4;
+
+  // level is the zlib compression level (1 fastest .. 9 smallest)
+  explicit GzipStreamBuffer(std::ostream& output, int level = 6);
+  ~GzipStreamBuffer();  // Finishes the stream if that has not been done
+
+  // Compress everything written so far, end the gzip stream and flush the
+  // underlying stream; returns false if compression or writing failed. Nothing
+  // may be written afterwards.
+  bool Finish();
+
+ protected:
+  std::streamsize xsputn(const char* data, std::streamsize length);
+  int overflow(int character);
+  int sync();
+
+ private:
+  // A block for the worker: the data, and whether to flush after it
+  struct Block {
+    std::string data;
+    bool flush;
+  };
+
+  void Queue(bool flush);
+  void Compress();  // The worker thread
+  bool Deflate(const std::string& data, int mode, std::vector<char>* out);
+
+  std::ostream& output_;
+  z_stream_s* stream_;
+  std::string block_;  // Block being filled
+
+  std::thread worker_;
+  std::mutex mutex_;
+  std::condition_variable queue_changed_;
+  std::deque<Block> queue_;
+  std::vector<std::string> free_blocks_;  // Compressed blocks, for reuse
+  bool finishing_;
+  bool finished_;
+  bool failed_;  // Only changed by the worker until it is joined
+};
+
+// A packet created into a file (or the standard output): the request, and the
+// files which go with it
+struct PacketFile {
+  PacketRequest request;
+  std::string output_file;   // Including '.tex'
+  std::string results_file;  // Results to load just for the packet, if any
+};
 
 // Prototypes
-template <size_t rows, size_t cols>
-void MakeTestPage(std::ofstream& output_file, int num_digits,
-                  std::pair<int, int> (&numbers_table)[rows][cols],
-                  std::string operation, bool include_solutions);
+bool ReadManifest(const std::string& manifest_file,
+                  const PacketRequest& defaults, const uint64_t* batch_seed,
+                  std::vector<PacketFile>* packets);
+
+bool ParseShard(const char* text, int* shard, int* num_shards);
+
+int WriteShard(const std::vector<PacketFile>& packets,
+               const OutputOptions& options, const std::string& index_file,
+               int shard, int num_shards);
+
+class CompletionIndex;
+
+int WritePackets(const std::vector<PacketFile>& packets,
+                 const OutputOptions& options, CompletionIndex* index);
+
+bool WritePacketFile(PacketGenerator* generator, const PacketFile& packet,
+                     const OutputOptions& options);
+
+bool WriteMappedPacketFile(PacketGenerator* generator,
+                           const PacketFile& packet,
+                           const OutputOptions& options);
+
+bool GeneratePacket(PacketGenerator* generator, const PacketFile& packet,
+                    const OutputOptions& options, std::ostream& out,
+                    OutputBuffer* key_output);
+
+bool GenerateCompressedPacket(PacketGenerator* generator,
+                              const PacketFile& packet,
+                              const OutputOptions& options, std::ostream& out,
+                              OutputBuffer* key_output);
+
+void PrintWarnings(const PacketGenerator& generator,
+                   const std::string& output_file);
+
+std::string OutputFileName(const PacketFile& packet,
+                           const OutputOptions& options);
+
+int RunServer(const std::string& socket_path, const PacketRequest& defaults,
+              const OutputOptions& options);
+
+struct ServerRequest;
+
+void ServeRequest(const ServerRequest& request, const PacketRequest& defaults,
+                  const OutputOptions& options);
+
+bool ParseServerRequest(const std::string& line, const PacketRequest& defaults,
+                        const OutputOptions& default_options,
+                        PacketRequest* packet, OutputOptions* options,
+                        std::string* error);
+
+bool OpenAnswerKey(const PacketFile& packet, AnswerKeyFormat format,
+                   std::ofstream* key_out);
+
+bool CloseAnswerKey(const PacketFile& packet, std::ofstream* key_out);
+
+void PrintStats(bool json);
 
 void UsageInformation(const char* program_name);
 
 // Main
 int main(int argc, char* argv[]) {
+  // Argument parsing is timed from the start in case --stats is given
+  static Stats run_stats;
+  bool stats_json = false;
+  std::chrono::steady_clock::time_point parse_start =
+      std::chrono::steady_clock::now();
+
   // Initialize default values and an output filestream
   int num_tests = 60;
   std::string output_file = "tests.tex";
-  std::string test_type = "a";
-  std::ofstream file_out;
+  Operation operation = kAddition;
+  std::vector<OperationWeight> mix;
+  OperandRange first_range = {0, 9};
+  OperandRange second_range = {0, 9};
+  int problems_per_test = 0;
+  int first_test = 0;
+  int num_selected = 0;
+  bool no_repeat = false;
+  bool unique = false;
+  std::string unique_store;
+  std::string results_file;
+  OutputOptions options;
+  options.format = kLatexOutput;
+  options.buffer_size = 1 << 20;
+  options.num_threads = 1;
+  options.pipe = false;
+  options.mmap = false;
+  options.gzip_level = 0;
+  options.answer_key = kNoAnswerKey;
+  options.fingerprints = NULL;
+  bool seed_given = false;
+  uint64_t seed = 0;
+  std::string manifest_file;
+  int shard = 0;
+  int num_shards = 0;
+  std::string socket_path;
 
   // Process arguments
   // http://www.gnu.org/software/libc/manual/html_node/Getopt.html
+  static const struct option long_options[] = {
+    {"buffer-size", required_argument, NULL, kBufferSizeOption},
+    {"pipe", no_argument, NULL, kPipeOption},
+    {"stats", optional_argument, NULL, kStatsOption},
+    {"no-repeat", no_argument, NULL, kNoRepeatOption},
+    {"answer-key", optional_argument, NULL, kAnswerKeyOption},
+    {"mmap", no_argument, NULL, kMmapOption},
+    {"cache-dir", required_argument, NULL, kCacheDirOption},
+    {"server", required_argument, NULL, kServerOption},
+    {"unique", no_argument, NULL, kUniqueOption},
+    {"unique-store", required_argument, NULL, kUniqueStoreOption},
+    {"results", required_argument, NULL, kResultsOption},
+    {"gzip", optional_argument, NULL, kGzipOption},
+    {"tests", required_argument, NULL, kTestsOption},
+    {"shard", required_argument, NULL, kShardOption},
+    {NULL, 0, NULL, 0}
+  };
   int curr_arg;
-  while ((curr_arg = getopt(argc, argv, "hn:o:t:")) != -1) {
+  while ((curr_arg = getopt_long(argc, argv, "b:f:hj:k:n:o:r:S:t:",
+                                 long_options, NULL)) != -1) {
     switch (curr_arg) {
+    case 'b':
+      // Batch mode: create the packets listed in the given manifest file
+      // (validity check is done later, when attempting to read the file)
+      {
+        manifest_file = optarg;
+      }
+
+      break;
+    case 'f':
+      // Set the format of the packet files; if the format argument is invalid,
+      // print an error message, print the usage message, and exit
+      {
+        if (strcmp(optarg, "tex") == 0) {
+          options.format = kLatexOutput;
+        } else if (strcmp(optarg, "pdf") == 0) {
+          options.format = kPdfOutput;
+        } else {
+          std::cerr << "Error: format (" << optarg << ") is not one of ";
+          std::cerr << "'tex' or 'pdf'." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+      }
+
+      break;
     case 'h':
       // Help
       // Print the usage message and exit
       UsageInformation(argv[0]);
 
       return 0;
+    case 'j':
+      // Set the number of threads used to render the test pages
+      {
+        // Verify num_threads is a positive integer; if not, print an error
+        // message, print the usage message, and exit
+        std::istringstream input(optarg);
+        if (!(input >> options.num_threads && input.eof() &&
+              options.num_threads > 0)) {
+          std::cerr << "Error: num_threads (" << optarg << ") is not a ";
+          std::cerr << "positive integer." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+      }
+
+      break;
+    case 'k':
+      // Set the number of problems per test (drawn from the pool)
+      {
+        // Verify num_problems is a positive integer; if not, print an error
+        // message, print the usage message, and exit
+        std::istringstream input(optarg);
+        if (!(input >> problems_per_test && input.eof() &&
+              problems_per_test > 0)) {
+          std::cerr << "Error: num_problems (" << optarg << ") is not a ";
+          std::cerr << "positive integer." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+      }
+
+      break;
     case 'n':
       // Set the number of tests to create
       {
-        // Verify num_tests is an integer between 1 and 999; if not, print
-        // an error message, print the usage message, and exit
+        // Verify num_tests is a positive integer; if not, print an error
+        // message, print the usage message, and exit
         std::istringstream input(optarg);
-        if (!(input >> num_tests && input.eof() && num_tests > 0 &&
-            num_tests < 1000)) {
+        if (!(input >> num_tests && input.eof() && num_tests > 0)) {
           std::cerr << "Error: num_tests (" << optarg << ") is not a positive ";
-          std::cerr << "integer between 1 and 999.";
+          std::cerr << "integer.";
           std::cerr << std::endl;
           UsageInformation(argv[0]);
 
@@ -57,10 +370,46 @@ int main(int argc, char* argv[]) {
       break;
     case 'o':
       // Set the output file name (validity check is done later, when attempting
-      // to start writing to the given file)
+      // to start writing to the given file); '-' writes to the standard output
       {
         output_file = optarg;
-        output_file += ".tex";
+        if (output_file != kStandardOutput) {
+          output_file += ".tex";
+        }
+      }
+
+      break;
+    case 'r':
+      // Set the ranges the operands are drawn from; if the argument is
+      // invalid, print an error message, print the usage message, and exit
+      {
+        if (!ParseRanges(optarg, &first_range, &second_range)) {
+          std::cerr << "Error: ranges (" << optarg << ") are not of the form ";
+          std::cerr << "low-high[,low-high] with 0 <= low <= high <= ";
+          std::cerr << kMaxOperand << "." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+      }
+
+      break;
+    case 'S':
+      // Set the seed of the random number generator
+      {
+        // Verify seed is a non-negative integer; if not, print an error
+        // message, print the usage message, and exit
+        std::istringstream input(optarg);
+        unsigned long long requested_seed;
+        if (!(optarg[0] != '-' && input >> requested_seed && input.eof())) {
+          std::cerr << "Error: seed (" << optarg << ") is not a non-negative ";
+          std::cerr << "integer." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+        seed = requested_seed;
+        seed_given = true;
       }
 
       break;
@@ -68,28 +417,82 @@ int main(int argc, char* argv[]) {
       // Set the type of tests to create; if the test_type argument is invalid,
       // print an error message, print the usage message, and exit
       {
-        switch (optarg[0]) {
-        case 'a':
-        case 'm':
-        case 's':
-        case 'd':
-          if (strlen(optarg) > 1) {
-            // Invalid argument
-            std::cerr << "Error: test_type (" << optarg << ") is not one of ";
-            std::cerr << "'a', 'm', 's', or 'd'." << std::endl;
-            UsageInformation(argv[0]);
+        if (!ParseTestType(optarg, &operation, &mix)) {
+          // Invalid argument
+          std::cerr << "Error: test_type (" << optarg << ") is not one of ";
+          std::cerr << "'a', 'm', 's', or 'd', or a mix of them with ";
+          std::cerr << "weights of at most " << kMaxMixWeight << ".";
+          std::cerr << std::endl;
+          UsageInformation(argv[0]);
 
-            return 1;
-          } else {
-            test_type = optarg;
-          }
+          return 1;
+        }
+      }
+
+      break;
+    case kBufferSizeOption:
+      // Set the number of bytes collected in memory before each write to the
+      // output file
+      {
+        // Verify buffer_size is a positive integer; if not, print an error
+        // message, print the usage message, and exit
+        std::istringstream input(optarg);
+        long long requested_size;
+        if (!(input >> requested_size && input.eof() && requested_size > 0)) {
+          std::cerr << "Error: buffer_size (" << optarg << ") is not a ";
+          std::cerr << "positive integer." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+        options.buffer_size = static_cast<size_t>(requested_size);
+      }
+
+      break;
+    case kStatsOption:
+      // Print timings and counters to the standard error at exit, as text or
+      // as JSON
+      {
+        if (optarg != NULL && strcmp(optarg, "json") == 0) {
+          stats_json = true;
+        } else if (optarg != NULL && strcmp(optarg, "text") != 0) {
+          std::cerr << "Error: stats format (" << optarg << ") is not one of ";
+          std::cerr << "'text' or 'json'." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+        stats = &run_stats;
+      }
+
+      break;
+    case kPipeOption:
+      // Stream the output to the standard output page by page
+      {
+        options.pipe = true;
+        output_file = kStandardOutput;
+      }
+
+      break;
+    case kMmapOption:
+      // Render the packet straight into a memory mapping of the output file
+      {
+        options.mmap = true;
+      }
 
-          break;
-        default:
-          {
-            // Invalid argument
-            std::cerr << "Error: test_type (" << optarg << ") is not one of ";
-            std::cerr << "'a', 'm', 's', or 'd'." << std::endl;
+      break;
+    case kGzipOption:
+      // Compress the packet files, at the given zlib level (6 by default); if
+      // the level is invalid, print an error message, print the usage
+      // message, and exit
+      {
+        options.gzip_level = 6;
+        if (optarg != NULL) {
+          std::istringstream input(optarg);
+          if (!(input >> options.gzip_level && input.eof() &&
+                options.gzip_level >= 1 && options.gzip_level <= 9)) {
+            std::cerr << "Error: gzip level (" << optarg << ") is not an ";
+            std::cerr << "integer from 1 to 9." << std::endl;
             UsageInformation(argv[0]);
 
             return 1;
@@ -97,14 +500,125 @@ int main(int argc, char* argv[]) {
         }
       }
 
+      break;
+    case kCacheDirOption:
+      // Reuse the preface pages (preamble, score tracker and solutions) of
+      // earlier runs from the given directory (validity check is done later,
+      // when attempting to read or write the cache)
+      {
+        options.cache_dir = optarg;
+      }
+
+      break;
+    case kServerOption:
+      // Server mode: serve packet requests on the given Unix socket (validity
+      // check is done later, when attempting to listen on the socket)
+      {
+        socket_path = optarg;
+      }
+
+      break;
+    case kTestsOption:
+      // Create only the given tests of the packet; if the argument is
+      // invalid, print an error message, print the usage message, and exit
+      // (whether the tests are in the packet is checked later, when creating
+      // it)
+      {
+        if (!ParseTestSelection(optarg, &first_test, &num_selected)) {
+          std::cerr << "Error: tests (" << optarg << ") are not of the form ";
+          std::cerr << "first[-last] with 1 <= first <= last." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+      }
+
+      break;
+    case kShardOption:
+      // Create only the given shard of the manifest's packets; if the argument
+      // is invalid, print an error message, print the usage message, and exit
+      {
+        if (!ParseShard(optarg, &shard, &num_shards)) {
+          std::cerr << "Error: shard (" << optarg << ") is not of the form ";
+          std::cerr << "i/N with 1 <= i <= N." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+      }
+
+      break;
+    case kUniqueOption:
+      // Redraw tests which repeat an earlier test of the packet (or batch)
+      {
+        unique = true;
+      }
+
+      break;
+    case kUniqueStoreOption:
+      // Unique tests across runs: keep the fingerprints of the tests in the
+      // given store (validity check is done later, when attempting to read
+      // the store)
+      {
+        unique = true;
+        unique_store = optarg;
+      }
+
+      break;
+    case kResultsOption:
+      // Draw the problems by the past results in the given file (validity
+      // check is done later, when attempting to read the file)
+      {
+        results_file = optarg;
+      }
+
+      break;
+    case kNoRepeatOption:
+      // Do not repeat problems across the tests of a packet until the whole
+      // pool has been used
+      {
+        no_repeat = true;
+      }
+
+      break;
+    case kAnswerKeyOption:
+      // Write the answer key of every test next to the packet, in binary
+      // (default) or as CSV
+      {
+        if (optarg == NULL || strcmp(optarg, "binary") == 0) {
+          options.answer_key = kBinaryAnswerKey;
+        } else if (strcmp(optarg, "csv") == 0) {
+          options.answer_key = kCsvAnswerKey;
+        } else {
+          std::cerr << "Error: answer key format (" << optarg << ") is not ";
+          std::cerr << "one of 'binary' or 'csv'." << std::endl;
+          UsageInformation(argv[0]);
+
+          return 1;
+        }
+      }
+
       break;
     case '?':
       // Invalid option or missing argument; print an error message, print the
       // usage message, and exit
       switch (optopt) {
+      case 'b':
+      case 'f':
+      case 'j':
+      case 'k':
       case 'n':
       case 'o':
+      case 'r':
+      case 'S':
       case 't':
+      case kBufferSizeOption:
+      case kCacheDirOption:
+      case kServerOption:
+      case kUniqueStoreOption:
+      case kResultsOption:
+      case kTestsOption:
+      case kShardOption:
         std::cerr << "Error: option -" << optopt << " requires an argument.";
         std::cerr << std::endl;
         break;
@@ -135,284 +649,1464 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  // Open the output file stream
-  file_out.open(output_file);
-
-  // Set up a table of pairs of digits
-  // * For subtraction, non-negative differences will be enforced by swapping
-  //   i and j when i < j. The effect here is that instead of only having 55 of
-  //   the 100 possible problems included, repeated problems will exist.
-  // * For division, a couple things need to change:
-  //   (a) The dividend will be i * j and the divisor will be i.
-  //   (b) Division by zero will be avoided by excluding the i == 0 cases when
-  //       shuffling the table (-1 placeholders will be used in those cases).
-  const int kNumDigits = 10;
-  std::pair<int, int> table[kNumDigits][kNumDigits];
-  for (int i = 0; i < kNumDigits; i++) {
-    for (int j = 0; j < kNumDigits; j++) {
-      if (test_type == "a" || test_type == "m") {
-        table[i][j] = std::make_pair(i, j);
-      } else if (test_type == "s") {
-        if (i < j) {
-          table[i][j] = std::make_pair(j, i);
-        } else {
-          table[i][j] = std::make_pair(i, j);
-        }
-      } else if (test_type == "d") {
-        if (i == 0) {
-          table[i][j] = std::make_pair(-1, -1);
-        } else {
-          table[i][j] = std::make_pair(i * j, i);
-        }
-      } else {
-        // Unknown test_type (test_type is validated at the start, so this
-        // should never be encountered)
-        std::cerr << "Error: test_type (" << test_type << ") is not one of ";
-        std::cerr << "'a', 'm', 's', or 'd'." << std::endl;
-      }
-    }
+  if (stats != NULL) {
+    stats->phase_time[Stats::kParse] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - parse_start).count();
   }
 
-  // Produce the tests and store them in the output file
-  for (int n = 0; n < num_tests; n++) {
-    // Check if the output file is open; if not, print an error message, print
-    // the usage message, and exit
-    if (!file_out.is_open()) {
-      std::cerr << "Error: unable to open input file" << output_file << ".";
-      std::cerr << std::endl;
-      UsageInformation(argv[0]);
+  // The answer key is named after the output file
+  if (options.answer_key != kNoAnswerKey && output_file == kStandardOutput) {
+    std::cerr << "Error: --answer-key needs an output file." << std::endl;
+    UsageInformation(argv[0]);
 
-      return 1;
-    } else {
-      // Create the LaTeX source code
-      if (n == 0) {
-        // Preamble
-        file_out << "\\documentclass[12pt, letterpaper]{article}\n";
-        file_out << "\\usepackage[margin=1in]{geometry}\n";
-        file_out << "\\usepackage{multicol}\n";
-        file_out << "\\usepackage{setspace}\n";
-        file_out << "\\usepackage{fancyhdr}\n";
-        file_out << "\\pagestyle{fancy}\n";
-        file_out << "\\renewcommand{\\headrulewidth}{0pt}\n";
-        file_out << "\\fancyhf{}\n";
-
-        // Document begin
-        // First page(s) is(are) a scoring tracker, second page is a solutions
-        // page, and all following pages are tests
-        file_out << "\\begin{document}\n";
-        file_out << "\\begin{multicols}{2}\n";
-        file_out << "\\setlength{\\columnseprule}{0.5pt}\n";
-        file_out << "{\\setstretch{1.5}\n";
-        file_out << "\\noindent\n";
-
-        // Score-tracking page:
-        for (int m = 1; m < num_tests + 1; m++) {
-          // Number of digits needed to dislay the number of tests included
-          int num_digits_needed = floor(log10(num_tests)) + 1;
-
-          // Number of digits in the current value of m
-          int num_digits_curr_m = floor(log10(m)) + 1;
-
-          // Buffer size = 11 (length of "\\phantom{}") + number of digits
-          // needed to display the number of tests included + 1 (null char)
-          int tot_buffer_size = 11 + num_digits_needed + 1;
-          char buffer[tot_buffer_size];
-
-          // Output score tracking lines for each test that will be generated
-          if (num_digits_needed - num_digits_curr_m > 0) {
-            file_out << "\\phantom{";
-            snprintf(buffer, tot_buffer_size, "%0*d",
-                     num_digits_needed - num_digits_curr_m, 0);
-            file_out << buffer << "}";
-          }
-          snprintf(buffer, tot_buffer_size, "%d", m);
-          file_out << buffer << ". Time: \\underline{\\hspace{6em}}";
-          file_out << "\\quad Correct: \\underline{\\hspace{3em}}";
-          if (m == num_tests) {
-            file_out << "\\par\n";
-          } else {
-            file_out << "\\\\\n";
-          }
-        }
+    return 1;
+  }
 
-        file_out << "}\n"; // Closing \setstretch
-        file_out << "\\end{multicols}\n";
-        file_out << "\\newpage\n";
+  // Only files can be mapped
+  if (options.mmap && output_file == kStandardOutput) {
+    std::cerr << "Error: --mmap needs an output file." << std::endl;
+    UsageInformation(argv[0]);
 
-        // Solutions page
-        MakeTestPage(file_out, kNumDigits, table, test_type, true);
+    return 1;
+  }
 
-        // Now that the preface pages are done, set up page numbering to apply
-        // to the test pages
-        file_out << "\\setcounter{page}{1}\n";
-        file_out << "\\lfoot{\\framebox{\\makebox[\\totalheight]{\\thepage}}}\n";
-      }
+  // Compressed output is written as a stream, not in place, and server
+  // clients receive the packet as it is
+  if (options.gzip_level > 0 && options.mmap) {
+    std::cerr << "Error: --gzip cannot be combined with --mmap." << std::endl;
+    UsageInformation(argv[0]);
 
-      // Regular test pages are generated here:
-      // Randomly shuffle the table of digit pairs
-      std::srand(time(NULL));
-      if (test_type == "d") {
-        std::random_shuffle(&table[0][0] + kNumDigits,
-                            &table[0][0] + kNumDigits * kNumDigits);
-      } else {
-        std::random_shuffle(&table[0][0],
-                            &table[0][0] + kNumDigits * kNumDigits);
-      }
+    return 1;
+  }
+  if (options.gzip_level > 0 && !socket_path.empty()) {
+    std::cerr << "Error: --gzip cannot be combined with --server." << std::endl;
+    UsageInformation(argv[0]);
 
-      // Create the test page
-      MakeTestPage(file_out, kNumDigits, table, test_type, false);
-    }
+    return 1;
   }
 
-  // Document end
-  file_out << "\\end{document}";
+  // Unique tests are redrawn from the random draws, which --no-repeat replaces
+  if (unique && no_repeat) {
+    std::cerr << "Error: --unique cannot be combined with --no-repeat.";
+    std::cerr << std::endl;
+    UsageInformation(argv[0]);
 
-  // Close output file
-  file_out.close();
+    return 1;
+  }
 
-  return 0;
-}
+  // Every node of a sharded batch derives the same packet seeds from the
+  // batch seed, and works on its own, so no fingerprints are shared
+  if (num_shards > 0 && manifest_file.empty()) {
+    std::cerr << "Error: --shard needs a manifest (-b)." << std::endl;
+    UsageInformation(argv[0]);
 
-// Output usage information
-void UsageInformation (const char* program_name) {
-  std::cout << std::endl;
-  std::cout << "usage: " << program_name << " [-h] [-n num_tests] ";
-  std::cout << "[-o output_file] [-t test_type]\n\n";
-  std::cout << "  -h              Print this message.\n";
-  std::cout << "  -n num_tests    The number of tests to create.\n";
-  std::cout << "                  num_tests must be an integer between 1 and ";
-  std::cout << "999.\n";
-  std::cout << "                  A scoring page fits 60 records.\n";
-  std::cout << "                  Default value: 60\n";
-  std::cout << "  -o output_file  The file in which to store the output.\n";
-  std::cout << "                  \'.tex\' will automatically be added.\n";
-  std::cout << "                  Default value: tests\n";
-  std::cout << "  -t test_type    The type of test to create.\n";
-  std::cout << "                  test_type is a single character indicating ";
-  std::cout << "the type of\n";
-  std::cout << "                  arithmetic operator to use in the tests:\n";
-  std::cout << "                    'a' - Addition\n";
-  std::cout << "                    'm' - Multiplication\n";
-  std::cout << "                    's' - Subtraction\n";
-  std::cout << "                    'd' - Division\n";
-  std::cout << "                  Default value: a\n";
-}
+    return 1;
+  }
+  if (num_shards > 0 && !seed_given) {
+    std::cerr << "Error: --shard needs a seed (-S)." << std::endl;
+    UsageInformation(argv[0]);
 
-// Generate a test page, possibly with solutions
-template <size_t rows, size_t cols>
-void MakeTestPage(std::ofstream& output_file, int num_digits,
-                  std::pair<int, int> (&numbers_table)[rows][cols],
-                  std::string operation, bool include_solutions) {
-  // When creating a division test, skip over the row of (-1, -1) pairs (which
-  // are used to indicate division by zero)
-  int start_row = 0;
-  if (operation == "d") {
-    start_row = 2;
-  }
-
-  // Output LaTeX source for the arithmetic problems. The problems are
-  // laid out in a num_digits x num_digits table, but each problem actually
-  // takes two rows (augend/multiplier/minued/dividend in one row,
-  // addend/multiplicand/subtrahend/divisor in the next), and there is an empty
-  // column between each problem for a grand total of 19 columns (= 10 problem
-  // columns + 9 empty columns) in the table.
-  output_file << "\\begin{tabular}{rrrrrrrrrrrrrrrrrrr}\n";
-
-  for (int curr_row = start_row; curr_row < 2 * num_digits; curr_row++) {
-    for (int curr_col = 0; curr_col < num_digits; curr_col++) {
-      if (curr_row % 2 == 0) {
-        // Augend/Multiplier/Minued/Dividend row
-        output_file << numbers_table[curr_row / 2][curr_col].first;
-      } else {
-        // Addend/Multiplicand/Subtrahend/Divisor row
-        // Output the operator
-        if (operation == "a") {
-          // Addition
-          output_file << "$+$ ";
-        } else if (operation == "m") {
-          // Multiplication
-          output_file << "$\\times$ ";
-        } else if (operation == "s") {
-          // Subtraction
-          output_file << "$-$ ";
-        } else if (operation == "d") {
-          // Division
-          output_file << "$\\div$ ";
-        } else {
-          // Unknown op (test_type is validated at the start, so this should
-          // never be encountered)
-          std::cerr << "Error: operation (" << operation << ") is not one of";
-          std::cerr << " 'a', 'm', 's', or 'd'." << std::endl;
-        }
+    return 1;
+  }
+  if (num_shards > 0 && unique) {
+    std::cerr << "Error: --unique cannot be combined with --shard.";
+    std::cerr << std::endl;
+    UsageInformation(argv[0]);
 
-        // Output the addend/multiplicand/subtrahend/divisor
-        output_file << numbers_table[curr_row / 2][curr_col].second;
-      }
-      if (curr_col == num_digits - 1) {
-        // At the end of the row; add new row
-        output_file << "\\\\" << std::endl;
-      } else {
-        // Not at the end of the row; add column separators
-        output_file << " & & ";
-      }
-    }
-
-    // If the addend/multiplicand/subtrahend/divisor row was just added, then
-    // add the horizontal separator lines and the solutions or a blank space
-    // row (depending on incl_sols)
-    if (curr_row % 2 != 0) {
-      // Add lines separating addends/multiplicands/subtrahends/divisors and
-      // sums/products/differences/quotients
-      for (int col = 0; col < 10; col++) {
-        output_file << "\\cline{" << 2 * col + 1 << "-" << 2 * col + 1 << "} ";
-      }
-
-      // Add solutions or empty row
-      // (blank space for writing in the sums/products/differences/quotients)
-      if (include_solutions) {
-        for (int col = 0; col < 10; col++) {
-          // Sums/Products/Differences/Quotients row
-          if (operation == "a") {
-            // Addition
-            output_file << numbers_table[curr_row / 2][col].first +
-              numbers_table[curr_row / 2][col].second;
-          } else if (operation == "m") {
-            // Multiplication
-            output_file << numbers_table[curr_row / 2][col].first *
-              numbers_table[curr_row / 2][col].second;
-          } else if (operation == "s") {
-            // Subtraction
-            output_file << numbers_table[curr_row / 2][col].first -
-              numbers_table[curr_row / 2][col].second;
-          } else if (operation == "d") {
-            // Division
-            output_file << numbers_table[curr_row / 2][col].first /
-            numbers_table[curr_row / 2][col].second;
-          } else {
-            // Unknown op (test_type is validated at the start, so this should
-            // never be encountered)
-            std::cerr << "Error: operation (" << operation << ") is not one of";
-            std::cerr << " 'a', 'm', 's', or 'd'." << std::endl;
-          }
+    return 1;
+  }
 
-          if (col == num_digits - 1) {
-            // At the end of the row; add solution and new row
-            output_file << "\\\\ \\\\";
-          } else {
-            // Not at the end of the row; add column separators
-            output_file << " & & ";
-          }
-        }
-      } else {
-        output_file << "\\\\ \\\\";
-      }
+  // Results bias the random draws, which --no-repeat replaces
+  if (!results_file.empty() && no_repeat) {
+    std::cerr << "Error: --results cannot be combined with --no-repeat.";
+    std::cerr << std::endl;
+    UsageInformation(argv[0]);
 
-      // End the current line of LaTeX source
-      output_file << std::endl;
+    return 1;
+  }
+
+  PacketRequest packet;
+  packet.operation = operation;
+  packet.mix = mix;
+  packet.first_range = first_range;
+  packet.second_range = second_range;
+  packet.problems_per_test = problems_per_test;
+  packet.no_repeat = no_repeat;
+  packet.unique = unique;
+  packet.num_tests = num_tests;
+  packet.first_test = first_test;
+  packet.num_selected = num_selected;
+  packet.results = NULL;
+
+  // Past results apply to every packet, unless a manifest line has its own
+  ProblemResults results;
+  if (!results_file.empty()) {
+    std::string error;
+    if (!results.Load(results_file, operation, &error)) {
+      std::cerr << "Error: " << error << "." << std::endl;
+      UsageInformation(argv[0]);
+
+      return 1;
     }
+    packet.results = &results;
   }
 
-  // End of current table and page
-  output_file << "\\end{tabular}\n";
-  output_file << "\\newpage\n";
-}
\ No newline at end of file
+  // Unique tests of a batch (or of all runs using the store) share their
+  // fingerprints; otherwise each packet has its own
+  FingerprintSet fingerprints;
+  if (!unique_store.empty() && !fingerprints.Load(unique_store)) {
+    std::cerr << "Error: unable to read fingerprint store " << unique_store;
+    std::cerr << "." << std::endl;
+    UsageInformation(argv[0]);
+
+    return 1;
+  }
+  if (unique && (!manifest_file.empty() || !unique_store.empty())) {
+    options.fingerprints = &fingerprints;
+  }
+
+  // Server mode: the command line options are the defaults for each request
+  int status = 0;
+  if (!socket_path.empty()) {
+    std::string error;
+    if (!CheckRanges(packet, &error)) {
+      std::cerr << "Error: " << error << "." << std::endl;
+      UsageInformation(argv[0]);
+
+      return 1;
+    }
+
+    status = RunServer(socket_path, packet, options);
+  } else if (!manifest_file.empty()) {
+    // Batch mode: the command line options are the defaults for each packet
+    // of the manifest, and the packets are spread across num_threads threads
+    std::vector<PacketFile> packets;
+    {
+      ScopedTimer timer(Stats::kParse);
+      if (!ReadManifest(manifest_file, packet, seed_given ? &seed : NULL,
+                        &packets)) {
+        UsageInformation(argv[0]);
+
+        return 1;
+      }
+    }
+
+    if (num_shards > 0) {
+      std::ostringstream index_file;
+      index_file << manifest_file << "." << shard + 1 << "-of-" << num_shards;
+      index_file << ".done";
+      status = WriteShard(packets, options, index_file.str(), shard,
+                          num_shards);
+    } else {
+      status = WritePackets(packets, options, NULL) == 0 ? 0 : 1;
+    }
+  } else {
+    std::string error;
+    if (!CheckRanges(packet, &error)) {
+      std::cerr << "Error: " << error << "." << std::endl;
+      UsageInformation(argv[0]);
+
+      return 1;
+    }
+
+    // Without a given seed, every run produces a different packet
+    PacketFile packet_file;
+    packet_file.request = packet;
+    packet_file.request.seed = seed_given ? seed : RandomSeed();
+    packet_file.output_file = output_file;
+
+    // Produce the tests and store them in the output file
+    PacketGenerator generator(options);
+    if (!WritePacketFile(&generator, packet_file, options)) {
+      UsageInformation(argv[0]);
+
+      status = 1;
+    }
+  }
+
+  // Keep the fingerprints of this run's tests for the next runs
+  if (!unique_store.empty() && !fingerprints.Save(unique_store)) {
+    std::cerr << "Error: unable to write fingerprint store " << unique_store;
+    std::cerr << "." << std::endl;
+    status = 1;
+  }
+
+  if (stats != NULL) {
+    PrintStats(stats_json);
+  }
+
+  return status;
+}
+
+// Read a batch manifest. Each line describes one packet:
+//   output_file [test_type [num_tests [seed [results_file]]]]
+// with the same meaning (and validity checks) as the corresponding options;
+// missing fields are taken from defaults. Packets without a seed (or with '-')
+// get one derived from the batch seed and output_file (see PacketSeed), or a
+// random one if batch_seed is NULL. The results file of a line is only read
+// when its packet is created (see WritePackets). Empty lines and lines
+// starting with '#' are skipped. Returns false (after printing an error
+// message) if the manifest cannot be used.
+bool ReadManifest(const std::string& manifest_file,
+                  const PacketRequest& defaults, const uint64_t* batch_seed,
+                  std::vector<PacketFile>* packets) {
+  std::ifstream manifest(manifest_file.c_str());
+  if (!manifest.is_open()) {
+    std::cerr << "Error: unable to open manifest file " << manifest_file;
+    std::cerr << "." << std::endl;
+
+    return false;
+  }
+
+  std::string line;
+  for (int line_number = 1; std::getline(manifest, line); line_number++) {
+    std::istringstream fields(line);
+    std::string output_file, test_type, num_tests, seed, results_file;
+    if (!(fields >> output_file) || output_file[0] == '#') {
+      continue;
+    }
+    fields >> test_type >> num_tests >> seed >> results_file;
+
+    // Packets from several threads cannot share the standard output
+    if (output_file == kStandardOutput) {
+      std::cerr << "Error: manifest line " << line_number << ": output_file ";
+      std::cerr << "cannot be the standard output in batch mode." << std::endl;
+
+      return false;
+    }
+
+    PacketFile packet;
+    packet.request = defaults;
+    packet.output_file = output_file + ".tex";
+    packet.request.seed = batch_seed != NULL ?
+        PacketSeed(*batch_seed, packet.output_file) : RandomSeed();
+
+    std::string extra;
+    if (fields >> extra) {
+      std::cerr << "Error: manifest line " << line_number << " has unused ";
+      std::cerr << "fields (" << extra << ")." << std::endl;
+
+      return false;
+    }
+    if (!test_type.empty() &&
+        !ParseTestType(test_type.c_str(), &packet.request.operation,
+                       &packet.request.mix)) {
+      std::cerr << "Error: manifest line " << line_number << ": test_type (";
+      std::cerr << test_type << ") is not one of 'a', 'm', 's', or 'd', or a ";
+      std::cerr << "mix of them." << std::endl;
+
+      return false;
+    }
+    if (!num_tests.empty()) {
+      std::istringstream input(num_tests);
+      if (!(input >> packet.request.num_tests && input.eof() &&
+            packet.request.num_tests > 0)) {
+        std::cerr << "Error: manifest line " << line_number << ": num_tests (";
+        std::cerr << num_tests << ") is not a positive integer." << std::endl;
+
+        return false;
+      }
+    }
+    if (!seed.empty() && seed != "-") {
+      std::istringstream input(seed);
+      unsigned long long requested_seed;
+      if (!(seed[0] != '-' && input >> requested_seed && input.eof())) {
+        std::cerr << "Error: manifest line " << line_number << ": seed (";
+        std::cerr << seed << ") is not a non-negative integer." << std::endl;
+
+        return false;
+      }
+      packet.request.seed = requested_seed;
+    }
+    if (!results_file.empty()) {
+      if (packet.request.no_repeat) {
+        std::cerr << "Error: manifest line " << line_number << ": results ";
+        std::cerr << "cannot be combined with --no-repeat." << std::endl;
+
+        return false;
+      }
+      packet.results_file = results_file;
+    }
+    std::string error;
+    if (!CheckRanges(packet.request, &error)) {
+      std::cerr << "Error: manifest line " << line_number << ": " << error;
+      std::cerr << "." << std::endl;
+
+      return false;
+    }
+
+    packets->push_back(packet);
+  }
+
+  return true;
+}
+
+// Convert a shard argument of the form i/N (shard i of N, from 1) to the shard
+// (from 0) and the number of shards; returns false if the argument is not of
+// that form or i > N
+bool ParseShard(const char* text, int* shard, int* num_shards) {
+  std::istringstream input(text);
+  int first;
+  int count;
+  char slash;
+  if (!(input >> first >> slash >> count) || slash != '/' || first < 1 ||
+      first > count || !input.eof()) {
+    return false;
+  }
+
+  *shard = first - 1;
+  *num_shards = count;
+
+  return true;
+}
+
+// Set when the server is asked to stop (SIGINT or SIGTERM)
+static volatile sig_atomic_t stop_server = 0;
+
+static void StopServer(int) {
+  stop_server = 1;
+}
+
+// A client connection of the server while its request line is read
+struct ServerConnection {
+  int fd;
+  std::string request;
+};
+
+// A request to be answered by a server worker: the request line, or the part
+// of it received if it was too long (complete is false then)
+struct ServerRequest {
+  int fd;
+  std::string line;
+  bool complete;
+};
+
+// Unbuffered stream buffer which sends to a socket (the output is collected in
+// an OutputBuffer in front of it); sending fails once the client is gone or has
+// taken no data for the send timeout of the socket
+class SocketStreamBuffer : public std::streambuf {
+ public:
+  explicit SocketStreamBuffer(int fd) : fd_(fd) {}
+
+ protected:
+  std::streamsize xsputn(const char* data, std::streamsize length) {
+    std::streamsize sent = 0;
+    while (sent < length) {
+      ssize_t result = send(fd_, data + sent, length - sent, MSG_NOSIGNAL);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      sent += result;
+    }
+
+    return sent;
+  }
+
+  int_type overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+      return traits_type::not_eof(c);
+    }
+    char character = traits_type::to_char_type(c);
+    return xsputn(&character, 1) == 1 ? c : traits_type::eof();
+  }
+
+ private:
+  int fd_;
+};
+
+// Serve packet requests on a Unix socket until SIGINT or SIGTERM. Each client
+// sends one request line (see ParseServerRequest), ended by a newline or by
+// closing its end of the connection, and receives the packet, followed by the
+// end of the connection. The request lines of all clients are read by one
+// poll() loop with non-blocking sockets; complete requests are queued for the
+// kServerWorkers worker threads, one of which creates the packet and streams
+// it to the client as it is created (see ServeRequest), so neither large
+// packets nor slow clients hold up the others. At most kMaxQueuedRequests
+// requests wait for a worker: while the queue is full, further requests are
+// answered with a busy error by the poll() loop. The problem pools and page
+// templates are set up once and reused by every request. Requests already
+// queued are still answered after SIGINT or SIGTERM. Returns the exit status.
+int RunServer(const std::string& socket_path, const PacketRequest& defaults,
+              const OutputOptions& options) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Error: socket path " << socket_path << " is too long.";
+    std::cerr << std::endl;
+
+    return 1;
+  }
+  strcpy(address.sun_path, socket_path.c_str());
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path.c_str());
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listen_fd, SOMAXCONN) != 0) {
+    std::cerr << "Error: unable to listen on socket " << socket_path;
+    std::cerr << "." << std::endl;
+    if (listen_fd >= 0) {
+      close(listen_fd);
+    }
+
+    return 1;
+  }
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = StopServer;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Each worker keeps taking the next queued request until the server stops
+  // and the queue is empty
+  struct RequestQueue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<ServerRequest> requests;
+    bool stopping;
+  };
+  struct Worker {
+    static void Run(RequestQueue* queue, const PacketRequest* defaults,
+                    const OutputOptions* options) {
+      for (;;) {
+        ServerRequest request;
+        {
+          std::unique_lock<std::mutex> lock(queue->mutex);
+          while (queue->requests.empty() && !queue->stopping) {
+            queue->ready.wait(lock);
+          }
+          if (queue->requests.empty()) {
+            return;
+          }
+          request = queue->requests.front();
+          queue->requests.pop_front();
+        }
+        ServeRequest(request, *defaults, *options);
+      }
+    }
+  };
+  RequestQueue queue;
+  queue.stopping = false;
+
+  // The workers (and their threads) block SIGINT and SIGTERM, so that the
+  // signals interrupt poll() in this thread
+  sigset_t stop_signals;
+  sigset_t signal_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &signal_mask);
+  std::vector<std::thread> workers;
+  for (int w = 0; w < kServerWorkers; w++) {
+    workers.push_back(std::thread(Worker::Run, &queue, &defaults, &options));
+  }
+  pthread_sigmask(SIG_SETMASK, &signal_mask, NULL);
+
+  std::vector<ServerConnection> connections;
+  std::vector<pollfd> poll_fds;
+  while (!stop_server) {
+    // Wait for new clients or request data
+    poll_fds.clear();
+    pollfd listen_poll = {listen_fd, POLLIN, 0};
+    poll_fds.push_back(listen_poll);
+    for (size_t c = 0; c < connections.size(); c++) {
+      pollfd connection_poll = {connections[c].fd, POLLIN, 0};
+      poll_fds.push_back(connection_poll);
+    }
+    if (poll(&poll_fds[0], poll_fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Error: poll failed." << std::endl;
+      break;
+    }
+
+    // Read the request lines, and queue each one once it is complete
+    for (size_t c = 0; c < connections.size(); c++) {
+      ServerConnection& connection = connections[c];
+      if (poll_fds[c + 1].revents == 0) {
+        continue;
+      }
+
+      char data[4096];
+      ssize_t length = recv(connection.fd, data, sizeof(data), 0);
+      if (length < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+          close(connection.fd);
+          connection.fd = -1;
+        }
+        continue;
+      }
+      connection.request.append(data, length);
+
+      // A client which closes its end without a newline ends the line
+      size_t end = connection.request.find('\n');
+      if (length == 0 && end == std::string::npos) {
+        end = connection.request.size();
+      }
+      if (length == 0 && end == 0) {
+        close(connection.fd);
+        connection.fd = -1;
+        continue;
+      }
+      if (end == std::string::npos && connection.request.size() < 4096) {
+        continue;
+      }
+
+      ServerRequest request = {connection.fd, connection.request,
+                               end != std::string::npos};
+      if (request.complete) {
+        request.line.resize(end);
+      }
+      bool queued = false;
+      {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.requests.size() < kMaxQueuedRequests) {
+          queue.requests.push_back(request);
+          queued = true;
+        }
+      }
+      if (queued) {
+        queue.ready.notify_one();
+      } else {
+        // The socket buffer of a new connection takes the line, so this
+        // does not block (and a client which cannot take it is just closed)
+        const char kBusy[] = "error: server busy (503), try again later\n";
+        send(connection.fd, kBusy, sizeof(kBusy) - 1,
+             MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(connection.fd);
+      }
+      connection.fd = -1;
+    }
+
+    // Drop connections which are closed or handed to the workers, then accept
+    // new ones
+    size_t num_open = 0;
+    for (size_t c = 0; c < connections.size(); c++) {
+      if (connections[c].fd >= 0) {
+        std::swap(connections[num_open++], connections[c]);
+      }
+    }
+    connections.resize(num_open);
+    if (poll_fds[0].revents & POLLIN) {
+      int fd;
+      while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        ServerConnection connection = {fd, ""};
+        connections.push_back(connection);
+      }
+    }
+  }
+
+  for (size_t c = 0; c < connections.size(); c++) {
+    close(connections[c].fd);
+  }
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.stopping = true;
+  }
+  queue.ready.notify_all();
+  for (size_t w = 0; w < workers.size(); w++) {
+    workers[w].join();
+  }
+
+  return 0;
+}
+
+// Answer a server request on its client socket, and close the connection. The
+// packet goes to the client through an OutputBuffer of options.buffer_size and
+// blocking sends, each block as soon as it is rendered, so a request holds one
+// buffer of memory however large its packet; a client which takes no data for
+// kServerSendTimeout seconds only holds up this worker until then. Once a send
+// fails, the packet is given up (see PacketGenerator::Generate).
+void ServeRequest(const ServerRequest& request, const PacketRequest& defaults,
+                  const OutputOptions& options) {
+  fcntl(request.fd, F_SETFL, fcntl(request.fd, F_GETFL) & ~O_NONBLOCK);
+  timeval timeout = {kServerSendTimeout, 0};
+  setsockopt(request.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  SocketStreamBuffer socket_buffer(request.fd);
+  std::ostream socket_out(&socket_buffer);
+
+  PacketRequest packet;
+  OutputOptions packet_options;
+  std::string error = "request too long";
+  if (request.complete &&
+      ParseServerRequest(request.line, defaults, options, &packet,
+                         &packet_options, &error)) {
+    // The generator writes nothing for an invalid request, so the error
+    // message is all the client gets then
+    PacketGenerator generator(packet_options);
+    OutputBuffer output(socket_out, options.buffer_size);
+    if (generator.Generate(packet, output, NULL)) {
+      output.Flush();
+      close(request.fd);
+
+      return;
+    }
+    error = generator.error();
+  }
+
+  // Only a client still taking data gets the error (a failed send means it
+  // is gone or has timed out)
+  if (socket_out.good()) {
+    socket_out << "error: " << error << "\n";
+    socket_out.flush();
+  }
+  close(request.fd);
+}
+
+// Parse a server request line:
+//   test_type [num_tests [seed [format [tests]]]]
+// with the same meaning (and validity checks) as the corresponding options;
+// missing fields are taken from defaults and default_options, and requests
+// without a seed get a random one. Returns false with an error message if the
+// request cannot be served.
+bool ParseServerRequest(const std::string& line, const PacketRequest& defaults,
+                        const OutputOptions& default_options,
+                        PacketRequest* packet, OutputOptions* options,
+                        std::string* error) {
+  std::istringstream fields(line);
+  std::string test_type, num_tests, seed, format, tests, extra;
+  fields >> test_type >> num_tests >> seed >> format >> tests;
+
+  *packet = defaults;
+  packet->seed = RandomSeed();
+  *options = default_options;
+  options->answer_key = kNoAnswerKey;
+  options->cache_dir.clear();
+  if (fields >> extra) {
+    *error = "unused fields (" + extra + ")";
+
+    return false;
+  }
+  if (!test_type.empty() &&
+      !ParseTestType(test_type.c_str(), &packet->operation, &packet->mix)) {
+    *error = "test_type (" + test_type + ") is not one of 'a', 'm', 's', or "
+             "'d', or a mix of them";
+
+    return false;
+  }
+  if (!num_tests.empty()) {
+    std::istringstream input(num_tests);
+    if (!(input >> packet->num_tests && input.eof() &&
+          packet->num_tests > 0)) {
+      *error = "num_tests (" + num_tests + ") is not a positive integer";
+
+      return false;
+    }
+  }
+  if (!seed.empty() && seed != "-") {
+    std::istringstream input(seed);
+    unsigned long long requested_seed;
+    if (!(seed[0] != '-' && input >> requested_seed && input.eof())) {
+      *error = "seed (" + seed + ") is not a non-negative integer";
+
+      return false;
+    }
+    packet->seed = requested_seed;
+  }
+  if (format == "tex") {
+    options->format = kLatexOutput;
+  } else if (format == "pdf") {
+    options->format = kPdfOutput;
+  } else if (!format.empty()) {
+    *error = "format (" + format + ") is not one of 'tex' or 'pdf'";
+
+    return false;
+  }
+  if (!tests.empty() && !ParseTestSelection(tests.c_str(), &packet->first_test,
+                                            &packet->num_selected)) {
+    *error = "tests (" + tests + ") are not of the form first[-last] with 1 "
+             "<= first <= last";
+
+    return false;
+  }
+  if (!CheckRanges(*packet, error)) {
+    return false;
+  }
+
+  // The size of the reply is bounded by its problems; every operation of a
+  // mix is counted with the pool of addition, the largest one
+  PacketRequest largest = *packet;
+  largest.operation = kAddition;
+  size_t problems_per_test = PoolSize(largest);
+  if (packet->problems_per_test > 0) {
+    problems_per_test = std::min(problems_per_test, static_cast<size_t>(
+        packet->problems_per_test));
+  }
+  size_t created_tests = packet->num_selected > 0 ?
+      std::min(packet->num_selected, packet->num_tests) : packet->num_tests;
+  if (created_tests > kMaxServerProblems / problems_per_test) {
+    std::ostringstream message;
+    message << "the packet has more than " << kMaxServerProblems;
+    message << " problems (" << created_tests << " tests of ";
+    message << problems_per_test;
+    message << ")";
+    *error = message.str();
+
+    return false;
+  }
+
+  return true;
+}
+
+// The packets of a shard which earlier runs have created, kept in a file with
+// a line "output_file seed" for each of them. A packet is added as soon as its
+// files are complete, so a run which is stopped or fails on some packets
+// leaves an index of the packets which do not have to be created again.
+class CompletionIndex {
+ public:
+  // Read the index file (if it exists) and open it for adding packets;
+  // returns false if it cannot be opened. Unreadable lines (such as a line
+  // cut off by a crash) are skipped.
+  bool Open(const std::string& index_file) {
+    std::ifstream index(index_file.c_str());
+    std::string line;
+    bool line_ended = true;
+    while (std::getline(index, line)) {
+      std::istringstream fields(line);
+      std::string output_file;
+      unsigned long long seed;
+      std::string extra;
+      if (fields >> output_file >> seed && !(fields >> extra)) {
+        done_[output_file] = seed;
+      }
+      line_ended = !index.eof();
+    }
+
+    out_.open(index_file.c_str(), std::ios::out | std::ios::app);
+    if (!line_ended) {
+      out_ << '\n';
+    }
+
+    return out_.is_open();
+  }
+
+  // Whether the packet (with the same seed) has been created
+  bool Contains(const PacketFile& packet) const {
+    std::map<std::string, uint64_t>::const_iterator it =
+        done_.find(packet.output_file);
+    return it != done_.end() && it->second == packet.request.seed;
+  }
+
+  // Add a created packet to the index file; may be called by several threads
+  // at once. Returns false if the index file cannot be written.
+  bool Add(const PacketFile& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out_ << packet.output_file << " "
+         << static_cast<unsigned long long>(packet.request.seed) << std::endl;
+
+    return out_.good();
+  }
+
+ private:
+  std::map<std::string, uint64_t> done_;
+  std::ofstream out_;
+  std::mutex mutex_;
+};
+
+// Create the packets of shard (from 0) of num_shards which are not in the
+// completion index file yet, adding them to it. A packet belongs to the shard
+// given by the hash of its output file (see PacketIdHash), which also derives
+// its seed, so every node running the same manifest with the same number of
+// shards finds the same packets in its shard, however the manifest lines are
+// ordered. Returns the exit status.
+int WriteShard(const std::vector<PacketFile>& packets,
+               const OutputOptions& options, const std::string& index_file,
+               int shard, int num_shards) {
+  CompletionIndex index;
+  if (!index.Open(index_file)) {
+    std::cerr << "Error: unable to open completion index " << index_file;
+    std::cerr << "." << std::endl;
+
+    return 1;
+  }
+
+  std::vector<PacketFile> shard_packets;
+  for (size_t p = 0; p < packets.size(); p++) {
+    uint64_t packet_shard = PacketIdHash(packets[p].output_file) % num_shards;
+    if (packet_shard == static_cast<uint64_t>(shard) &&
+        !index.Contains(packets[p])) {
+      shard_packets.push_back(packets[p]);
+    }
+  }
+
+  return WritePackets(shard_packets, options, &index) == 0 ? 0 : 1;
+}
+
+// Create all of the given packets, num_threads packets at a time, adding each
+// created packet to index (unless it is NULL); returns the number of packets
+// which could not be created
+int WritePackets(const std::vector<PacketFile>& packets,
+                 const OutputOptions& options, CompletionIndex* index) {
+  std::atomic<size_t> next_packet(0);
+  std::atomic<int> num_failed(0);
+
+  // Each thread keeps taking the next packet which has not been started yet
+  // and creates it on its own
+  struct Worker {
+    static void Run(const std::vector<PacketFile>* packets,
+                    const OutputOptions* options, CompletionIndex* index,
+                    std::atomic<size_t>* next_packet,
+                    std::atomic<int>* num_failed) {
+      OutputOptions packet_options = *options;
+      packet_options.num_threads = 1;
+      PacketGenerator generator(packet_options);  // For all its packets
+      for (size_t p = (*next_packet)++; p < packets->size();
+           p = (*next_packet)++) {
+        const PacketFile& packet = (*packets)[p];
+        bool created;
+        if (packet.results_file.empty()) {
+          created = WritePacketFile(&generator, packet, packet_options);
+        } else {
+          // Results of their own are loaded just for the packet, so that a
+          // batch of many students never holds the results of all of them
+          ProblemResults results;
+          std::string error;
+          created = results.Load(packet.results_file,
+                                 packet.request.operation, &error);
+          if (!created) {
+            std::cerr << "Error: " << error << "." << std::endl;
+          } else {
+            PacketFile student_packet = packet;
+            student_packet.request.results = &results;
+            created = WritePacketFile(&generator, student_packet,
+                                      packet_options);
+          }
+        }
+
+        if (created && index != NULL && !index->Add(packet)) {
+          std::cerr << "Error: unable to write completion index." << std::endl;
+          created = false;
+        }
+        if (!created) {
+          (*num_failed)++;
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = 1; t < options.num_threads; t++) {
+    workers.push_back(std::thread(Worker::Run, &packets, &options, index,
+                                  &next_packet, &num_failed));
+  }
+  Worker::Run(&packets, &options, index, &next_packet, &num_failed);
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+
+  return num_failed;
+}
+
+// Create a packet with generator (created with options) and store it in its
+// output file (or write it to the standard output); returns false (after
+// printing an error message) if the output file cannot be opened
+bool WritePacketFile(PacketGenerator* generator, const PacketFile& packet,
+                     const OutputOptions& options) {
+  if (packet.output_file == kStandardOutput) {
+    if (options.gzip_level > 0 ?
+        !GenerateCompressedPacket(generator, packet, options, std::cout,
+                                  NULL) :
+        !GeneratePacket(generator, packet, options, std::cout, NULL)) {
+      return false;
+    }
+    std::cout.flush();
+    if (!std::cout) {
+      std::cerr << "Error: unable to write to the standard output.";
+      std::cerr << std::endl;
+
+      return false;
+    }
+    PrintWarnings(*generator, packet.output_file);
+
+    return true;
+  }
+
+  if (options.mmap) {
+    return WriteMappedPacketFile(generator, packet, options);
+  }
+
+  // Open the output file stream; all output goes through a buffer so that the
+  // file is written in large blocks
+  const std::string output_file = OutputFileName(packet, options);
+  std::ofstream file_out(output_file.c_str(),
+                         std::ios::out | std::ios::binary);
+
+  // Check if the output file is open
+  if (!file_out.is_open()) {
+    std::cerr << "Error: unable to open input file" << output_file;
+    std::cerr << "." << std::endl;
+
+    return false;
+  }
+
+  // The answer key is written in the same pass, through its own buffer
+  std::ofstream key_out;
+  if (options.answer_key != kNoAnswerKey &&
+      !OpenAnswerKey(packet, options.answer_key, &key_out)) {
+    return false;
+  }
+  OutputBuffer key_output(key_out, options.buffer_size);
+  OutputBuffer* key = options.answer_key != kNoAnswerKey ? &key_output : NULL;
+
+  if (options.gzip_level > 0 ?
+      !GenerateCompressedPacket(generator, packet, options, file_out, key) :
+      !GeneratePacket(generator, packet, options, file_out, key)) {
+    return false;
+  }
+
+  PrintWarnings(*generator, output_file);
+
+  // Write out any remaining buffered output and close the files; the packet
+  // is only written once all of it is in them
+  key_output.Flush();
+  ScopedTimer timer(Stats::kWrite);
+  file_out.close();
+  if (!file_out) {
+    std::cerr << "Error: unable to write output file " << output_file;
+    std::cerr << "." << std::endl;
+
+    return false;
+  }
+
+  return CloseAnswerKey(packet, &key_out);
+}
+
+// Create a packet on the given stream through a buffer, so that the stream is
+// written in large blocks, and flush the buffer; returns false (after printing
+// an error message) if the packet cannot be created
+bool GeneratePacket(PacketGenerator* generator, const PacketFile& packet,
+                    const OutputOptions& options, std::ostream& out,
+                    OutputBuffer* key_output) {
+  OutputBuffer output(out, options.buffer_size, options.pipe);
+  if (!generator->Generate(packet.request, output, key_output)) {
+    std::cerr << "Error: " << generator->error() << "." << std::endl;
+
+    return false;
+  }
+  output.Flush();
+
+  return true;
+}
+
+// Create a packet on the given stream like GeneratePacket, compressing it on
+// the way (see GzipStreamBuffer); the answer key is not compressed
+bool GenerateCompressedPacket(PacketGenerator* generator,
+                              const PacketFile& packet,
+                              const OutputOptions& options, std::ostream& out,
+                              OutputBuffer* key_output) {
+  GzipStreamBuffer gzip(out, options.gzip_level);
+  std::ostream gzip_out(&gzip);
+  if (!GeneratePacket(generator, packet, options, gzip_out, key_output)) {
+    return false;
+  }
+
+  ScopedTimer timer(Stats::kWrite);
+  if (!gzip.Finish()) {
+    std::cerr << "Error: unable to write compressed output of ";
+    std::cerr << packet.output_file << "." << std::endl;
+
+    return false;
+  }
+
+  return true;
+}
+
+// Create a packet file by rendering the packet straight into a memory mapping
+// of the file (see OutputBuffer); the tests of each chunk are rendered by the
+// threads at their final offsets in the file
+bool WriteMappedPacketFile(PacketGenerator* generator,
+                           const PacketFile& packet,
+                           const OutputOptions& options) {
+  const std::string output_file = OutputFileName(packet, options);
+  int fd = open(output_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    std::cerr << "Error: unable to open input file" << output_file;
+    std::cerr << "." << std::endl;
+
+    return false;
+  }
+
+  std::ofstream key_out;
+  if (options.answer_key != kNoAnswerKey &&
+      !OpenAnswerKey(packet, options.answer_key, &key_out)) {
+    close(fd);
+
+    return false;
+  }
+  OutputBuffer key_output(key_out, options.buffer_size);
+
+  OutputBuffer output(fd);
+  if (!generator->Generate(packet.request, output,
+                           options.answer_key != kNoAnswerKey ? &key_output :
+                                                               NULL)) {
+    std::cerr << "Error: " << generator->error() << "." << std::endl;
+    output.Close();
+    close(fd);
+
+    return false;
+  }
+  PrintWarnings(*generator, output_file);
+  key_output.Flush();
+
+  ScopedTimer timer(Stats::kWrite);
+  bool written = output.Close();
+  if (close(fd) != 0) {
+    written = false;
+  }
+  if (!written) {
+    std::cerr << "Error: unable to write output file " << output_file;
+    std::cerr << "." << std::endl;
+
+    return false;
+  }
+
+  return CloseAnswerKey(packet, &key_out);
+}
+
+// Print the warnings of the packet just created: a problem the generator ran
+// into (such as a preface cache it could not use), and tests of a unique
+// packet which could not be made unique
+void PrintWarnings(const PacketGenerator& generator,
+                   const std::string& output_file) {
+  if (!generator.warning().empty()) {
+    std::cerr << "Warning: " << generator.warning() << "." << std::endl;
+  }
+  if (generator.repeated_tests() > 0) {
+    std::cerr << "Warning: " << generator.repeated_tests() << " tests of ";
+    std::cerr << output_file << " repeat earlier tests (the ranges do not ";
+    std::cerr << "have enough different tests)." << std::endl;
+  }
+}
+
+// Name of the file a packet is written to: the requested name (which includes
+// '.tex'), with '.tex' replaced by '.pdf' for PDF output, and '.gz' appended
+// for compressed output
+std::string OutputFileName(const PacketFile& packet,
+                           const OutputOptions& options) {
+  std::string output_file = packet.output_file;
+  if (options.format == kPdfOutput && output_file.size() >= 4 &&
+      output_file.compare(output_file.size() - 4, 4, ".tex") == 0) {
+    output_file.replace(output_file.size() - 4, 4, ".pdf");
+  }
+  if (options.gzip_level > 0) {
+    output_file += ".gz";
+  }
+
+  return output_file;
+}
+
+// Open the answer key file of a packet: the output file name with '.tex'
+// replaced by '.key' (binary) or '.csv'
+bool OpenAnswerKey(const PacketFile& packet, AnswerKeyFormat format,
+                   std::ofstream* key_out) {
+  std::string key_file = packet.output_file;
+  if (key_file.size() >= 4 &&
+      key_file.compare(key_file.size() - 4, 4, ".tex") == 0) {
+    key_file.erase(key_file.size() - 4);
+  }
+  key_file += format == kCsvAnswerKey ? ".csv" : ".key";
+
+  key_out->open(key_file.c_str(), std::ios::out | std::ios::binary);
+  if (!key_out->is_open()) {
+    std::cerr << "Error: unable to open answer key file " << key_file;
+    std::cerr << "." << std::endl;
+
+    return false;
+  }
+
+  return true;
+}
+
+// Close the answer key file of a packet, if it is open; returns false (after
+// printing an error message) if the key could not be written
+bool CloseAnswerKey(const PacketFile& packet, std::ofstream* key_out) {
+  if (!key_out->is_open()) {
+    return true;
+  }
+
+  key_out->close();
+  if (!*key_out) {
+    std::cerr << "Error: unable to write the answer key of ";
+    std::cerr << packet.output_file << "." << std::endl;
+
+    return false;
+  }
+
+  return true;
+}
+
+GzipStreamBuffer::GzipStreamBuffer(std::ostream& output, int level)
+    : output_(output), stream_(new z_stream_s()), finishing_(false),
+      finished_(false), failed_(false) {
+  // 15 + 16 are the default window bits plus a gzip rather than zlib wrapper
+  if (deflateInit2(stream_, level, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    delete stream_;
+    stream_ = NULL;
+    failed_ = true;
+  }
+
+  block_.reserve(kBlockSize);
+  worker_ = std::thread(&GzipStreamBuffer::Compress, this);
+}
+
+GzipStreamBuffer::~GzipStreamBuffer() {
+  Finish();
+  if (stream_ != NULL) {
+    deflateEnd(stream_);
+    delete stream_;
+  }
+}
+
+bool GzipStreamBuffer::Finish() {
+  if (!finished_) {
+    Queue(false);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finishing_ = true;
+    }
+    queue_changed_.notify_all();
+    worker_.join();
+    finished_ = true;
+    output_.flush();
+  }
+  return !failed_ && output_.good();
+}
+
+std::streamsize GzipStreamBuffer::xsputn(const char* data,
+                                         std::streamsize length) {
+  std::streamsize written = 0;
+  while (written < length) {
+    size_t part = std::min(static_cast<size_t>(length - written),
+                           kBlockSize - block_.size());
+    block_.append(data + written, part);
+    written += part;
+    if (block_.size() == kBlockSize) {
+      Queue(false);
+    }
+  }
+  return written;
+}
+
+int GzipStreamBuffer::overflow(int character) {
+  if (character != traits_type::eof()) {
+    char c = static_cast<char>(character);
+    xsputn(&c, 1);
+  }
+  return traits_type::not_eof(character);
+}
+
+int GzipStreamBuffer::sync() {
+  Queue(true);
+  return 0;
+}
+
+void GzipStreamBuffer::Queue(bool flush) {
+  if (finished_ || (block_.empty() && !flush)) {
+    return;
+  }
+
+  std::string next;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_changed_.wait(lock, [this] {
+      return queue_.size() < kMaxQueuedBlocks;
+    });
+    queue_.push_back(Block());
+    queue_.back().data.swap(block_);
+    queue_.back().flush = flush;
+    if (!free_blocks_.empty()) {
+      next.swap(free_blocks_.back());
+      free_blocks_.pop_back();
+    }
+  }
+  queue_changed_.notify_all();
+
+  block_.swap(next);
+  block_.clear();
+  block_.reserve(kBlockSize);
+}
+
+void GzipStreamBuffer::Compress() {
+  std::vector<char> out;
+  Block block;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (block.data.capacity() != 0) {
+        free_blocks_.push_back(std::string());
+        free_blocks_.back().swap(block.data);
+      }
+      queue_changed_.wait(lock, [this] {
+        return finishing_ || !queue_.empty();
+      });
+      if (queue_.empty()) {
+        break;
+      }
+      block.data.swap(queue_.front().data);
+      block.flush = queue_.front().flush;
+      queue_.pop_front();
+    }
+    queue_changed_.notify_all();
+
+    if (!failed_ && Deflate(block.data, block.flush ? Z_SYNC_FLUSH : Z_NO_FLUSH,
+                            &out)) {
+      output_.write(out.data(), out.size());
+      if (block.flush) {
+        output_.flush();
+      }
+    }
+    block.data.clear();
+  }
+
+  if (!failed_ && Deflate(std::string(), Z_FINISH, &out)) {
+    output_.write(out.data(), out.size());
+  }
+}
+
+bool GzipStreamBuffer::Deflate(const std::string& data, int mode,
+                               std::vector<char>* out) {
+  stream_->next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream_->avail_in = static_cast<uInt>(data.size());
+
+  // deflateBound covers the input, plus some room for the flush markers; the
+  // loop below grows the output should that ever fall short
+  out->resize(deflateBound(stream_, data.size()) + 64);
+  size_t used = 0;
+  for (;;) {
+    stream_->next_out = reinterpret_cast<Bytef*>(&(*out)[used]);
+    stream_->avail_out = static_cast<uInt>(out->size() - used);
+    int result = deflate(stream_, mode);
+    used = out->size() - stream_->avail_out;
+    if (result == Z_STREAM_ERROR) {
+      failed_ = true;
+      return false;
+    }
+    if (stream_->avail_out != 0 && stream_->avail_in == 0 &&
+        (mode != Z_FINISH || result == Z_STREAM_END)) {
+      break;
+    }
+    out->resize(2 * out->size());
+  }
+  out->resize(used);
+
+  if (!output_.good()) {
+    failed_ = true;
+  }
+  return !failed_;
+}
+
+// Print the timings and counters collected with --stats to the standard error
+void PrintStats(bool json) {
+  static const char* const kPhaseNames[Stats::kNumPhases] = {
+    "parse", "setup", "shuffle", "render", "write"
+  };
+
+  if (json) {
+    std::cerr << "{";
+    for (int phase = 0; phase < Stats::kNumPhases; phase++) {
+      std::cerr << "\"" << kPhaseNames[phase] << "_seconds\": ";
+      std::cerr << stats->phase_time[phase] / 1e9 << ", ";
+    }
+    std::cerr << "\"bytes_written\": " << stats->bytes_written << ", ";
+    std::cerr << "\"flushes\": " << stats->num_flushes << "}" << std::endl;
+  } else {
+    std::cerr << "Time per phase (summed over all threads):\n";
+    for (int phase = 0; phase < Stats::kNumPhases; phase++) {
+      std::cerr << "  " << std::left << std::setw(9) << kPhaseNames[phase];
+      std::cerr << std::right << std::fixed << std::setprecision(6);
+      std::cerr << std::setw(12) << stats->phase_time[phase] / 1e9 << " s\n";
+    }
+    std::cerr << "Bytes written: " << stats->bytes_written << "\n";
+    std::cerr << "Flushes:       " << stats->num_flushes << std::endl;
+  }
+}
+
+// Output usage information
+void UsageInformation (const char* program_name) {
+  std::cout << std::endl;
+  std::cout << "usage: " << program_name << " [-b manifest] [-f format] ";
+  std::cout << "[-h] [-j num_threads]\n";
+  std::cout << "       [-k num_problems] [-n num_tests] [-o output_file] ";
+  std::cout << "[-r ranges] [-S seed]\n";
+  std::cout << "       [-t test_type] ";
+  std::cout << "[--answer-key[=format]] [--buffer-size bytes]\n";
+  std::cout << "       [--cache-dir dir] ";
+  std::cout << "[--gzip[=level]] [--mmap] [--no-repeat] [--pipe]\n";
+  std::cout << "       [--results file] [--server socket] ";
+  std::cout << "[--shard i/N] [--tests first[-last]]\n";
+  std::cout << "       [--unique] [--unique-store file] ";
+  std::cout << "[--stats[=format]]\n\n";
+  std::cout << "  -b manifest     Create every packet listed in manifest.\n";
+  std::cout << "                  Each line of manifest has the form\n";
+  std::cout << "                    output_file [test_type [num_tests ";
+  std::cout << "[seed\n";
+  std::cout << "                      [results_file]]]]\n";
+  std::cout << "                  Missing fields are taken from the other ";
+  std::cout << "options.\n";
+  std::cout << "                  A missing seed (or '-') is derived from ";
+  std::cout << "-S and\n";
+  std::cout << "                  output_file, or random without -S; ";
+  std::cout << "results_file\n";
+  std::cout << "                  replaces --results for the packet of the ";
+  std::cout << "line.\n";
+  std::cout << "  -f format       The format of the packet files.\n";
+  std::cout << "                  'tex' - LaTeX source, to be processed ";
+  std::cout << "separately\n";
+  std::cout << "                  'pdf' - PDF with the same layout ('.tex' ";
+  std::cout << "becomes '.pdf')\n";
+  std::cout << "                  Default value: tex\n";
+  std::cout << "  -h              Print this message.\n";
+  std::cout << "  -j num_threads  The number of threads used to create the ";
+  std::cout << "tests.\n";
+  std::cout << "                  The output does not depend on num_threads.\n";
+  std::cout << "                  In batch mode, packets are spread across ";
+  std::cout << "the threads.\n";
+  std::cout << "                  Default value: 1\n";
+  std::cout << "  -k num_problems The number of problems on each test, ";
+  std::cout << "drawn at random\n";
+  std::cout << "                  from every combination of the ranges.\n";
+  std::cout << "                  Default value: every combination\n";
+  std::cout << "  -n num_tests    The number of tests to create.\n";
+  std::cout << "                  num_tests must be a positive integer.\n";
+  std::cout << "                  A scoring page fits 60 records.\n";
+  std::cout << "                  Default value: 60\n";
+  std::cout << "  -o output_file  The file in which to store the output.\n";
+  std::cout << "                  \'.tex\' will automatically be added.\n";
+  std::cout << "                  \'-\' writes to the standard output.\n";
+  std::cout << "                  Default value: tests\n";
+  std::cout << "  -r ranges       The ranges the operands are drawn from.\n";
+  std::cout << "                  ranges has the form low-high[,low-high] ";
+  std::cout << "(first\n";
+  std::cout << "                  and second operand); a single range ";
+  std::cout << "applies to both.\n";
+  std::cout << "                  For division, these are the divisor and ";
+  std::cout << "quotient.\n";
+  std::cout << "                  Each test has every combination of the ";
+  std::cout << "ranges.\n";
+  std::cout << "                  Default value: 0-9,0-9\n";
+  std::cout << "  -S seed         The seed of the random number generator.\n";
+  std::cout << "                  The same seed produces the same packet.\n";
+  std::cout << "                  Default value: random\n";
+  std::cout << "  -t test_type    The type of test to create.\n";
+  std::cout << "                  test_type is a single character indicating ";
+  std::cout << "the type of\n";
+  std::cout << "                  arithmetic operator to use in the tests:\n";
+  std::cout << "                    'a' - Addition\n";
+  std::cout << "                    'm' - Multiplication\n";
+  std::cout << "                    's' - Subtraction\n";
+  std::cout << "                    'd' - Division\n";
+  std::cout << "                  Several characters mix the operations: ";
+  std::cout << "each test\n";
+  std::cout << "                  is of one of them, at random. A weight ";
+  std::cout << "after a\n";
+  std::cout << "                  character makes its tests more likely, ";
+  std::cout << "e.g. 'a3m1'\n";
+  std::cout << "                  has 3 addition tests per multiplication ";
+  std::cout << "test.\n";
+  std::cout << "                  Default value: a\n";
+  std::cout << "  --answer-key[=format]\n";
+  std::cout << "                  Also write the problems and answers of ";
+  std::cout << "every test,\n";
+  std::cout << "                  in order, to output_file.key (format ";
+  std::cout << "'binary') or\n";
+  std::cout << "                  output_file.csv (format 'csv').\n";
+  std::cout << "                  Default value: binary\n";
+  std::cout << "  --buffer-size bytes\n";
+  std::cout << "                  The number of bytes of output collected in ";
+  std::cout << "memory before\n";
+  std::cout << "                  each write to output_file.\n";
+  std::cout << "                  Default value: 1048576\n";
+  std::cout << "  --cache-dir dir Reuse the preamble, score tracker and ";
+  std::cout << "solutions pages\n";
+  std::cout << "                  of earlier packets of the same test_type, ";
+  std::cout << "ranges\n";
+  std::cout << "                  and num_tests from dir (created on first ";
+  std::cout << "use).\n";
+  std::cout << "                  Only applies to LaTeX output.\n";
+  std::cout << "  --gzip[=level]  Compress output_file (named output_file.gz) ";
+  std::cout << "with gzip at\n";
+  std::cout << "                  the given level, from 1 (fastest) to 9 ";
+  std::cout << "(smallest), while\n";
+  std::cout << "                  the packet is created. Answer keys are ";
+  std::cout << "not compressed.\n";
+  std::cout << "                  Default value: 6\n";
+  std::cout << "  --mmap          Render the packet straight into a memory ";
+  std::cout << "mapping of\n";
+  std::cout << "                  output_file, which is preallocated on ";
+  std::cout << "disk.\n";
+  std::cout << "  --no-repeat     Do not repeat a problem in the packet until ";
+  std::cout << "every\n";
+  std::cout << "                  combination of the ranges has been used.\n";
+  std::cout << "  --pipe          Stream the output to the standard output ";
+  std::cout << "page by page\n";
+  std::cout << "                  (same as -o -, but each page is passed on ";
+  std::cout << "as soon as it\n";
+  std::cout << "                  is done).\n";
+  std::cout << "  --results file  Draw the problems of each test by the ";
+  std::cout << "past results in\n";
+  std::cout << "                  file, so that missed problems come up ";
+  std::cout << "more often\n";
+  std::cout << "                  (problems may then repeat within a ";
+  std::cout << "test). file is\n";
+  std::cout << "                  CSV with first, second and correct (0 ";
+  std::cout << "or 1) columns,\n";
+  std::cout << "                  such as an answer key with a correct ";
+  std::cout << "column added,\n";
+  std::cout << "                  or a binary results file.\n";
+  std::cout << "  --server socket Serve packets on the Unix socket until ";
+  std::cout << "interrupted. Each\n";
+  std::cout << "                  client sends one line of the form\n";
+  std::cout << "                    test_type [num_tests [seed [format ";
+  std::cout << "[tests]]]]\n";
+  std::cout << "                  and receives the packet; the other ";
+  std::cout << "options are the\n";
+  std::cout << "                  defaults.\n";
+  std::cout << "  --shard i/N     Create only shard i of N of the manifest's ";
+  std::cout << "packets (with -b\n";
+  std::cout << "                  and -S), skipping packets listed as done by ";
+  std::cout << "earlier runs\n";
+  std::cout << "                  in manifest.i-of-N.done. The shard of a ";
+  std::cout << "packet depends\n";
+  std::cout << "                  only on its output_file.\n";
+  std::cout << "  --tests first[-last]\n";
+  std::cout << "                  Create only tests first to last of the ";
+  std::cout << "packet (numbered\n";
+  std::cout << "                  from 1, as on the score tracker), without ";
+  std::cout << "the score\n";
+  std::cout << "                  tracker and solutions pages. The tests ";
+  std::cout << "are the same as in\n";
+  std::cout << "                  the whole packet, and only they are ";
+  std::cout << "created.\n";
+  std::cout << "  --unique        Redraw every test which repeats an earlier ";
+  std::cout << "test of the\n";
+  std::cout << "                  packet (or of the manifest, in batch ";
+  std::cout << "mode).\n";
+  std::cout << "  --unique-store file\n";
+  std::cout << "                  Same as --unique, but across all runs ";
+  std::cout << "using file, which\n";
+  std::cout << "                  keeps the fingerprints of their tests ";
+  std::cout << "(created on first\n";
+  std::cout << "                  use).\n";
+  std::cout << "  --stats[=format]\n";
+  std::cout << "                  Print the time spent in each phase, the ";
+  std::cout << "bytes written and\n";
+  std::cout << "                  the number of flushes to the standard ";
+  std::cout << "error at exit.\n";
+  std::cout << "                  format is \'text\' or \'json\'.\n";
+  std::cout << "                  Default value: text\n";
+}
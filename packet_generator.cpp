@@ -0,0 +1,2774 @@
+// Packet generation (see packet_generator.h): problem pools, test page
+// templates and rendering, answer keys, the preface cache and PDF output.
+
+#include "packet_generator.h"
+#include "packet_generator_internal.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace packet_generator {
+
+// Minimal PDF writer: numbered objects are written one after the other to an
+// OutputBuffer, and the cross-reference table is built at the end. All pages
+// share one Helvetica font and resource dictionary, and a page is drawn by one
+// or more content streams, so parts shared by many pages are written only once.
+class PdfWriter {
+ public:
+  explicit PdfWriter(OutputBuffer& output);
+
+  // Write the file header and the shared font and resources
+  void Start();
+
+  // Write content as a stream object and return its object number
+  int AddStream(const std::string& content);
+
+  // Add a page drawn by the given content streams, in order
+  void AddPage(const int* streams, int num_streams);
+
+  // Hint that num_pages more pages (with one content stream of their own each)
+  // are going to follow, so that the object tables are allocated in one go
+  void Expect(size_t num_pages);
+
+  // Write the page tree, catalog, cross-reference table and trailer
+  void Finish();
+
+ private:
+  // Start the next object and return its number
+  int BeginObject();
+
+  // Objects are written piece by piece rather than formatted with streams, so
+  // that adding a page does not allocate
+  void Write(const std::string& text);
+  void Write(const char* text);
+  void WriteNumber(size_t value, int width = 0);  // Zero-padded to width
+
+  OutputBuffer& output_;
+  size_t offset_;               // Bytes written so far
+  std::vector<size_t> offsets_;  // Offset of each object, by object number
+  std::vector<int> pages_;       // Page object numbers
+  std::string page_start_;       // Page dictionary up to the content streams
+};
+
+// Layout of the problems on a page: rows of kProblemsPerRow problems with an
+// empty column between each problem (19 table columns in total)
+const int kProblemsPerRow = 10;
+const int kRowsPerPage = 10;
+const int kProblemsPerPage = kProblemsPerRow * kRowsPerPage;
+
+// Decimal text of the numbers 0..9999, right-aligned with spaces in 4
+// characters, so that a number of up to n digits is the last n characters of
+// its entry. All numbers of the output (operands, answers, page and test
+// numbers, PDF coordinates and offsets) are copied from here instead of being
+// formatted digit by digit.
+struct DigitTable {
+  DigitTable();
+
+  char text[10000][4];
+  uint8_t length[10000];  // Number of digits
+};
+
+static const DigitTable kDigitTable;
+
+// Operation traits. Each operation provides:
+// * Glyph(): the LaTeX source for the operator
+// * PdfGlyph(): the operator as a WinAnsi (Helvetica) string
+// * kName: the test_type character of the operation
+// * kOperation: the Operation value of the operation
+// * IncludeRow(i): whether the operand value i (from the first range) makes up
+//   problems (with each value j of the second range)
+// * First(i, j), Second(i, j): the operands of the problem made up by i and j
+// * Answer(i, j): the answer to that problem (only used when the problem pool
+//   is built)
+// The functions which depend on the operation are templated on these, so the
+// operation is resolved at compile time rather than in the inner loops. The
+// operand and answer functions are free of branches and divisions, so that
+// the pool is built by vector code (see BuildProblemSet).
+struct Addition {
+  static const char* Glyph() { return "$+$ "; }
+  static const char* PdfGlyph() { return "+"; }
+  static const char kName = 'a';
+  static const Operation kOperation = kAddition;
+  static bool IncludeRow(int) { return true; }
+  static int First(int i, int) { return i; }
+  static int Second(int, int j) { return j; }
+  static int Answer(int i, int j) { return i + j; }
+};
+
+struct Multiplication {
+  static const char* Glyph() { return "$\\times$ "; }
+  static const char* PdfGlyph() { return "\xD7"; }
+  static const char kName = 'm';
+  static const Operation kOperation = kMultiplication;
+  static bool IncludeRow(int) { return true; }
+  static int First(int i, int) { return i; }
+  static int Second(int, int j) { return j; }
+  static int Answer(int i, int j) { return i * j; }
+};
+
+// Non-negative differences are enforced by swapping i and j when i < j (as the
+// larger and smaller of the two). The effect here is that instead of only
+// having 55 of the 100 possible problems included, repeated problems will
+// exist.
+struct Subtraction {
+  static const char* Glyph() { return "$-$ "; }
+  static const char* PdfGlyph() { return "-"; }
+  static const char kName = 's';
+  static const Operation kOperation = kSubtraction;
+  static bool IncludeRow(int) { return true; }
+  static int First(int i, int j) { return std::max(i, j); }
+  static int Second(int i, int j) { return std::min(i, j); }
+  static int Answer(int i, int j) { return std::max(i, j) - std::min(i, j); }
+};
+
+// The dividend is i * j and the divisor is i (so j is the quotient). Division
+// by zero is avoided by excluding the i == 0 row.
+struct Division {
+  static const char* Glyph() { return "$\\div$ "; }
+  static const char* PdfGlyph() { return "\xF7"; }
+  static const char kName = 'd';
+  static const Operation kOperation = kDivision;
+  static bool IncludeRow(int i) { return i != 0; }
+  static int First(int i, int j) { return i * j; }
+  static int Second(int i, int) { return i; }
+  static int Answer(int, int j) { return j; }
+};
+
+Stats* stats = NULL;
+
+// Prototypes
+struct ChunkTest;
+
+void WritePreamble(OutputBuffer& output);
+
+void WritePreface(OutputBuffer& output,
+                  const std::vector<const ProblemSetup*>& setups,
+                  int num_tests);
+
+void WriteSelectedPreface(OutputBuffer& output, int first_page);
+
+bool WriteCachedPreface(OutputBuffer& output, const PacketRequest& packet,
+                        const std::vector<const ProblemSetup*>& setups,
+                        const std::string& cache_dir, std::string* warning);
+
+void WriteAnswerKeys(OutputBuffer& key_output, AnswerKeyFormat key_format,
+                     const AnswerKeyRecord* keys, int first_test,
+                     int num_tests, const ProblemSetup* const* setups,
+                     const ChunkTest* chunk, bool mixed);
+
+void WriteScoreTracker(OutputBuffer& output, int num_tests);
+
+struct PdfProblemLayout;
+
+void WritePdfScoreTracker(PdfWriter& pdf, int num_tests);
+
+void WritePdfProblemPage(PdfWriter& pdf, PdfProblemLayout* layout,
+                         const AnswerKeyRecord* problems, size_t num_problems,
+                         bool include_solutions, int page_number);
+
+double PdfTextWidth(const char* text, size_t length);
+
+char* FormatNumber(char* end, uint64_t value);
+
+template <typename Op>
+void BuildProblemSet(OperandRange first_range, OperandRange second_range,
+                     ProblemSet* problems);
+
+template <typename Op>
+void FillProblemRow(int i, int j_low, int count, int16_t* __restrict__ first,
+                    int16_t* __restrict__ second, int32_t* __restrict__ answer);
+
+template <typename Op>
+void MakeTestPage(OutputBuffer& output_file, const ProblemSet& problems,
+                  size_t begin, size_t end, bool include_solutions);
+
+template <typename Op>
+PageTemplate BuildPageTemplate(size_t num_problems, int first_width,
+                               int second_width);
+
+struct SampleWorkspace;
+
+struct AliasTable;
+
+void RenderTest(char* test, const ProblemSetup& setup, Xoshiro256* test_rng,
+                const AliasTable* alias_table, SampleWorkspace* workspace,
+                AnswerKeyRecord* keys);
+
+void RenderChunk(char* tests, const ProblemSetup* const* setups,
+                 const ChunkTest* chunk, Xoshiro256* test_rngs,
+                 const AliasTable* alias_tables, SampleWorkspace* workspaces,
+                 SampleWorkspace* dealt, AnswerKeyRecord* keys, int first,
+                 int num_tests, int step);
+
+static inline uint32_t RandomBelow(Xoshiro256& rng, uint32_t bound);
+
+static inline uint64_t MixBits(uint64_t z);
+
+int DrawPart(Xoshiro256& test_rng, const std::vector<uint32_t>& weight_sums);
+
+void ShuffleDeck(ProblemSet* deck, const ProblemSet& pool, uint64_t seed,
+                 int part, uint64_t pass);
+
+void SampleProblems(ProblemSet* problems, size_t num_samples, Xoshiro256& rng,
+                    std::vector<uint32_t>* swaps);
+
+void UndoSample(ProblemSet* problems, const std::vector<uint32_t>& swaps);
+
+uint64_t TestFingerprint(char operation, const AnswerKeyRecord* problems,
+                         size_t num_problems);
+
+// Per-thread state used to draw the problems of tests. When sampling,
+// pool is a private copy of the problem pool which each test partially
+// shuffles (see SampleProblems) and restores afterwards, so the cost per
+// test scales with the problems per test rather than the pool size. Without
+// repeats, each test of a chunk has a workspace of its own instead, whose pool
+// starts with the problems already drawn for it.
+struct SampleWorkspace {
+  ProblemSet pool;
+  std::vector<uint32_t> swaps;
+  ProblemSet weighted;  // The problems of a test drawn by weight
+};
+
+// Alias table (Vose's method) for drawing the problems of a pool by weight in
+// constant time: a column is picked uniformly, and then either the problem of
+// the column or its alias, depending on the threshold of the column. Both
+// choices come out of one 64-bit random number.
+struct AliasTable {
+  void Build(const std::vector<double>& weights);
+
+  uint32_t Draw(Xoshiro256& rng) const {
+    const uint64_t random = rng();
+    const uint32_t column = static_cast<uint32_t>(
+        ((random >> 32) * thresholds.size()) >> 32);
+    return static_cast<uint32_t>(random) < thresholds[column] ? column :
+                                                                aliases[column];
+  }
+
+  std::vector<uint32_t> thresholds;  // Out of 2^32
+  std::vector<uint32_t> aliases;
+};
+
+// Place of a test within a chunk of tests (see WritePacket): its part (the
+// index of its operation in the mix of a mixed packet, 0 otherwise), the offset
+// of its pages in the chunk, the offset of its answer key records in the keys
+// of the chunk, and the packet page number of its first page
+struct ChunkTest {
+  int part;
+  size_t offset;
+  size_t key_offset;
+  int first_page;
+};
+
+// Geometry of the problem pages of PDF output (see WritePdfProblemPage). The
+// operators and rules of a page only depend on the number of problems on it,
+// so they are drawn by a content stream shared by all such pages.
+struct PdfProblemLayout {
+  std::string glyph;
+  double first_width;   // Width of the widest first operand
+  double second_width;  // Width of the widest second operand
+  std::map<size_t, int> grids;  // Shared stream by number of problems
+
+  // Content stream of the current page; cleared for each page but kept
+  // allocated, so pages after the first few are drawn without allocating
+  std::string content;
+};
+
+// The arguments of RenderChunk for the tests of a chunk, but the share of a
+// thread
+struct ChunkTask {
+  char* tests;
+  const ProblemSetup* const* setups;
+  const ChunkTest* chunk;
+  Xoshiro256* test_rngs;
+  const AliasTable* alias_tables;
+  SampleWorkspace* workspaces;  // num_parts per thread, thread 0 first
+  int num_parts;
+  SampleWorkspace* dealt;
+  AnswerKeyRecord* keys;
+  int num_tests;
+};
+
+// Threads which render the tests of the chunks of a packet along with the
+// thread creating it (see WritePacket). A generator starts them on its first
+// packet and keeps them for all later ones, so a chunk only costs waking them
+// up. The pool copies the threads sample from are kept as well, and only
+// copied again for a packet with another problem pool.
+class RenderPool {
+ public:
+  // num_threads includes the thread creating the packets
+  explicit RenderPool(int num_threads);
+  ~RenderPool();  // Stops the threads
+
+  // Pool copies for num_threads threads of the parts with the given setups,
+  // num_parts per thread (thread 0 first)
+  SampleWorkspace* Workspaces(const ProblemSetup* const* setups,
+                              int num_parts);
+
+  // Render the tests of task on the current thread and num_workers - 1 pool
+  // threads (see RenderChunk), and return once all of them are done
+  void Run(const ChunkTask& task, int num_workers);
+
+ private:
+  void Work(int thread);
+
+  std::vector<std::thread> threads_;
+  std::vector<SampleWorkspace> workspaces_;
+  std::vector<const ProblemSetup*> workspace_setups_;  // Pool of each copy
+
+  std::mutex mutex_;
+  std::condition_variable started_;
+  std::condition_variable finished_;
+  const ChunkTask* task_;
+  int num_workers_;
+  uint64_t generation_;  // Number of tasks run so far
+  int pending_;          // Pool threads still rendering the current task
+  bool stopping_;
+};
+
+PacketGenerator::PacketGenerator(const OutputOptions& options)
+    : options_(options), repeated_tests_(0) {
+  if (options_.answer_key == kNoAnswerKey) {
+    options_.answer_key = kBinaryAnswerKey;
+  }
+}
+
+PacketGenerator::~PacketGenerator() {
+}
+
+// Check the packet before anything is written, so that a failed call leaves
+// output untouched
+bool PacketGenerator::Generate(const PacketRequest& packet,
+                               OutputBuffer& output, OutputBuffer* key_output) {
+  error_.clear();
+  warning_.clear();
+  repeated_tests_ = 0;
+  if (options_.num_threads < 1) {
+    error_ = "num_threads is not a positive integer";
+
+    return false;
+  }
+  if (packet.num_tests <= 0) {
+    error_ = "num_tests is not a positive integer";
+
+    return false;
+  }
+  if (packet.unique && packet.no_repeat) {
+    error_ = "unique tests cannot be combined with no_repeat";
+
+    return false;
+  }
+  if (packet.results != NULL && packet.no_repeat) {
+    error_ = "results cannot be combined with no_repeat";
+
+    return false;
+  }
+  if (packet.num_selected < 0 || packet.first_test < 0 ||
+      packet.first_test > packet.num_tests - packet.num_selected) {
+    error_ = "the selected tests are not tests of the packet";
+
+    return false;
+  }
+  if (packet.num_selected > 0 && packet.unique) {
+    error_ = "unique tests cannot be selected";
+
+    return false;
+  }
+  if (!CheckRanges(packet, &error_)) {
+    return false;
+  }
+
+  if (!WritePacket(packet, output, key_output)) {
+    error_ = "unable to write the output";
+
+    return false;
+  }
+
+  return true;
+}
+
+// Convert a test_type argument to the corresponding operation; returns false if
+// the argument is not one of 'a', 'm', 's', or 'd'
+bool ParseOperation(const char* text, Operation* operation) {
+  if (strlen(text) != 1) {
+    return false;
+  }
+
+  switch (text[0]) {
+  case 'a':
+    *operation = kAddition;
+    return true;
+  case 'm':
+    *operation = kMultiplication;
+    return true;
+  case 's':
+    *operation = kSubtraction;
+    return true;
+  case 'd':
+    *operation = kDivision;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Convert a test_type argument to the operation of a packet and, for a mix of
+// operations, the operations of the mix: each operation character may be
+// followed by its weight (1..kMaxMixWeight, 1 if not given), as in "amsd" or
+// "a3m1". A single operation (with or without a weight) leaves mix empty.
+// Returns false if the argument is not of that form or names an operation
+// twice.
+bool ParseTestType(const char* text, Operation* operation,
+                   std::vector<OperationWeight>* mix) {
+  std::vector<OperationWeight> parts;
+  const char* curr_char = text;
+  while (*curr_char != '\0') {
+    const char name[2] = {*curr_char++, '\0'};
+    OperationWeight part;
+    if (!ParseOperation(name, &part.operation)) {
+      return false;
+    }
+    part.weight = 1;
+    if (*curr_char >= '0' && *curr_char <= '9') {
+      part.weight = 0;
+      while (*curr_char >= '0' && *curr_char <= '9') {
+        part.weight = part.weight * 10 + (*curr_char++ - '0');
+        if (part.weight > kMaxMixWeight) {
+          return false;
+        }
+      }
+      if (part.weight == 0) {
+        return false;
+      }
+    }
+    for (size_t p = 0; p < parts.size(); p++) {
+      if (parts[p].operation == part.operation) {
+        return false;
+      }
+    }
+    parts.push_back(part);
+  }
+  if (parts.empty()) {
+    return false;
+  }
+
+  *operation = parts[0].operation;
+  if (parts.size() == 1) {
+    parts.clear();
+  }
+  mix->swap(parts);
+
+  return true;
+}
+
+// Convert a ranges argument of the form low-high[,low-high] to the ranges of
+// the first and second operands (a single range applies to both); returns
+// false if the argument is not of that form or a range is not within
+// 0..kMaxOperand
+bool ParseRanges(const char* text, OperandRange* first_range,
+                 OperandRange* second_range) {
+  std::istringstream input(text);
+  OperandRange ranges[2];
+  int num_ranges = 0;
+  char separator = ',';
+  while (num_ranges < 2 && separator == ',') {
+    OperandRange& range = ranges[num_ranges++];
+    char dash;
+    if (!(input >> range.low >> dash >> range.high) || dash != '-' ||
+        range.low < 0 || range.low > range.high || range.high > kMaxOperand) {
+      return false;
+    }
+    if (!(input >> separator)) {
+      break;
+    }
+    if (separator != ',' || num_ranges == 2) {
+      return false;
+    }
+  }
+
+  *first_range = ranges[0];
+  *second_range = ranges[num_ranges - 1];
+
+  return true;
+}
+
+// Convert a tests argument of the form first[-last] (test numbers from 1, as on
+// the score tracker) to the first test (from 0) and number of tests of a
+// selection (see PacketRequest); returns false if the argument is not of that
+// form or first > last
+bool ParseTestSelection(const char* text, int* first_test, int* num_selected) {
+  std::istringstream input(text);
+  int first;
+  int last;
+  char dash;
+  if (!(input >> first) || first < 1) {
+    return false;
+  }
+  last = first;
+  if (input >> dash && (dash != '-' || !(input >> last) || last < first)) {
+    return false;
+  }
+  if (!input.eof()) {
+    return false;
+  }
+
+  *first_test = first - 1;
+  *num_selected = last - first + 1;
+
+  return true;
+}
+
+// Check that the operand ranges of a packet can be used for its operation and
+// hold enough problems for a test; returns false with an error message if not.
+// Division needs a non-zero divisor, and the dividends have to fit into the
+// 16-bit operands. Every operation of a mixed packet has to meet these on its
+// own.
+bool CheckRanges(const PacketRequest& packet, std::string* error) {
+  if (!packet.mix.empty()) {
+    PacketRequest part = packet;
+    part.mix.clear();
+    for (size_t p = 0; p < packet.mix.size(); p++) {
+      if (packet.mix[p].weight < 1 || packet.mix[p].weight > kMaxMixWeight) {
+        std::ostringstream message;
+        message << "the weights of a mix are not in 1.." << kMaxMixWeight;
+        *error = message.str();
+
+        return false;
+      }
+      part.operation = packet.mix[p].operation;
+      if (!CheckRanges(part, error)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  const OperandRange ranges[2] = {packet.first_range, packet.second_range};
+  for (int r = 0; r < 2; r++) {
+    if (ranges[r].low < 0 || ranges[r].low > ranges[r].high ||
+        ranges[r].high > kMaxOperand) {
+      std::ostringstream message;
+      message << "ranges are not of the form low-high with 0 <= low <= high ";
+      message << "<= " << kMaxOperand;
+      *error = message.str();
+
+      return false;
+    }
+  }
+  if (packet.operation == kDivision &&
+      (packet.first_range.high == 0 ||
+       packet.first_range.high * packet.second_range.high > INT16_MAX)) {
+    std::ostringstream message;
+    message << "division needs a divisor range with a non-zero value, and ";
+    message << "divisors times quotients of at most " << INT16_MAX;
+    *error = message.str();
+
+    return false;
+  }
+  if (packet.problems_per_test < 0 ||
+      static_cast<size_t>(packet.problems_per_test) > PoolSize(packet)) {
+    std::ostringstream message;
+    message << "num_problems (" << packet.problems_per_test << ") is larger ";
+    message << "than the number of problems of the ranges (";
+    message << PoolSize(packet) << ")";
+    *error = message.str();
+
+    return false;
+  }
+
+  return true;
+}
+
+// Number of problems in the pool of the operation of a packet (see
+// BuildProblemSet)
+size_t PoolSize(const PacketRequest& packet) {
+  size_t num_first = packet.first_range.high - packet.first_range.low + 1;
+  size_t num_second = packet.second_range.high - packet.second_range.low + 1;
+  if (packet.operation == kDivision && packet.first_range.low == 0) {
+    // No division by zero
+    num_first--;
+  }
+
+  return num_first * num_second;
+}
+
+// Seed for packets without a given seed
+uint64_t RandomSeed() {
+  std::random_device entropy;
+  return (static_cast<uint64_t>(entropy()) << 32) ^ entropy() ^
+         static_cast<uint64_t>(time(NULL));
+}
+
+// FNV-1a hash of the id of a packet of a batch (its output file), which
+// places the packet in a shard of the batch and derives its seed
+uint64_t PacketIdHash(const std::string& packet_id) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t c = 0; c < packet_id.size(); c++) {
+    hash = (hash ^ static_cast<uint8_t>(packet_id[c])) * 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+// Seed for a packet of a batch from the seed of the batch and the packet's id:
+// the hash of the id, combined with the batch seed and finished with the
+// SplitMix64 mixing function. Every packet of a batch gets a different seed,
+// which depends on nothing else, so the packets do not depend on the order or
+// grouping in which they are created
+uint64_t PacketSeed(uint64_t batch_seed, const std::string& packet_id) {
+  return MixBits(PacketIdHash(packet_id) ^ batch_seed);
+}
+
+// Redraws of a unique test before it is left repeating an earlier test (when
+// the operand ranges have too few different tests)
+const int kMaxUniqueAttempts = 100;
+
+// Create the LaTeX source code (or the PDF file, see options.format) for a full
+// packet: preamble, score tracker, solutions pages, and num_tests tests. The
+// tests are rendered by options.num_threads threads; each test is shuffled with
+// its own random number stream, which is set up directly from the packet seed
+// and the number of the test, so the output does not depend on the number of
+// threads. If key_output is given, the answer key of every test is written to
+// it in options.answer_key format as the tests are rendered.
+//
+// With packet.num_selected, only the selected tests are created, as a document
+// of just their pages (numbered as in the full packet); they are the same as
+// in the full packet, and only cost as much as the tests created. The decks of
+// a packet without repeats are set up directly at the first selected test, as
+// each pass through a deck is shuffled with a stream of its own.
+//
+// Each test of a mixed packet is of one of the operations of the mix, drawn
+// by weight as the first number of the stream of the test; the preface has
+// the solutions pages of every operation of the mix, in order.
+//
+// With packet.unique, a test which repeats an earlier test (of the packet, or
+// of options.fingerprints) is redrawn from its own stream, in test order, so
+// unique packets do not depend on the number of threads either. Sets
+// repeated_tests_ to the number of tests which still repeat one after
+// kMaxUniqueAttempts redraws, and warning_ if the preface cache cannot be used.
+bool PacketGenerator::WritePacket(const PacketRequest& packet,
+                                  OutputBuffer& output,
+                                  OutputBuffer* key_output) {
+  const OutputOptions& options = options_;
+  // Pool of problems (see the operation traits for how each operation sets it
+  // up) and test page templates of each operation of the packet
+  std::vector<const ProblemSetup*> setups;
+  std::vector<uint32_t> weight_sums;  // Of the parts up to each part
+  const bool mixed = !packet.mix.empty();
+  if (mixed) {
+    uint32_t weight_sum = 0;
+    for (size_t p = 0; p < packet.mix.size(); p++) {
+      setups.push_back(&ProblemSetup::Get(
+          packet.mix[p].operation, packet.first_range, packet.second_range,
+          packet.problems_per_test));
+      weight_sum += packet.mix[p].weight;
+      weight_sums.push_back(weight_sum);
+    }
+  } else {
+    setups.push_back(&ProblemSetup::Get(
+        packet.operation, packet.first_range, packet.second_range,
+        packet.problems_per_test));
+  }
+  const int num_parts = static_cast<int>(setups.size());
+  const int num_tests = packet.num_tests;
+  const int num_threads = options.num_threads;
+  const AnswerKeyFormat key_format = options.answer_key;
+
+  // Tests to create: all of them, or the selected ones
+  const bool selected = packet.num_selected > 0;
+  const int begin_test = selected ? packet.first_test : 0;
+  const int end_test = selected ? packet.first_test + packet.num_selected :
+                                  num_tests;
+
+  // Part of each test of a mixed packet, up to the last test created (the
+  // tests before the first one decide its page number and deck positions)
+  std::vector<int> test_parts;
+  if (mixed) {
+    test_parts.resize(end_test);
+    for (int n = 0; n < end_test; n++) {
+      Xoshiro256 test_rng(packet.seed, n);
+      test_parts[n] = DrawPart(test_rng, weight_sums);
+    }
+  }
+
+  // Page number of the first test created
+  int next_page = 1;
+  if (mixed) {
+    for (int n = 0; n < begin_test; n++) {
+      next_page += static_cast<int>(setups[test_parts[n]]->num_pages());
+    }
+  } else {
+    next_page += begin_test * static_cast<int>(setups[0]->num_pages());
+  }
+
+  // Preamble, score tracker and solutions pages; these do not depend on the
+  // seed, so they can be reused from earlier runs. PDF output is never cached.
+  // Selected tests only have the preamble.
+  const bool pdf_output = options.format == kPdfOutput;
+  PdfWriter pdf(output);
+  std::vector<PdfProblemLayout> pdf_layouts(pdf_output ? num_parts : 0);
+  if (pdf_output) {
+    pdf.Start();
+    if (!selected) {
+      WritePdfScoreTracker(pdf, num_tests);
+    }
+
+    ScopedTimer timer(Stats::kRender);
+    for (int p = 0; p < num_parts; p++) {
+      const ProblemSetup& setup = *setups[p];
+      const ProblemSet& problems = setup.problems;
+      PdfProblemLayout& pdf_layout = pdf_layouts[p];
+      pdf_layout.glyph = setup.pdf_glyph;
+      pdf_layout.first_width = setup.full_page.first_width *
+                               PdfTextWidth("0", 1);
+      pdf_layout.second_width = setup.full_page.second_width *
+                                PdfTextWidth("0", 1);
+      if (selected) {
+        continue;
+      }
+
+      std::vector<AnswerKeyRecord> solutions(problems.size());
+      for (size_t k = 0; k < problems.size(); k++) {
+        solutions[k].first = problems.first[k];
+        solutions[k].second = problems.second[k];
+        solutions[k].answer = problems.answer[k];
+      }
+      for (size_t begin = 0; begin < problems.size();
+           begin += kProblemsPerPage) {
+        WritePdfProblemPage(pdf, &pdf_layout, &solutions[begin],
+                            std::min<size_t>(kProblemsPerPage,
+                                             problems.size() - begin),
+                            true, 0);
+      }
+    }
+  } else if (selected) {
+    WriteSelectedPreface(output, next_page);
+  } else if (options.cache_dir.empty()) {
+    WritePreface(output, setups, num_tests);
+  } else {
+    WriteCachedPreface(output, packet, setups, options.cache_dir, &warning_);
+  }
+
+  // Regular tests are generated here, a chunk of tests at a time. The tests of
+  // a chunk are rendered straight into consecutive slots of the output buffer
+  // (all of the same size, unless the packet is mixed) and then written out in
+  // order. A chunk holds up to 64 tests (or about 4 MB) per thread. When
+  // streaming, each chunk is just one test per thread and is passed on as soon
+  // as it is done, starting with the preface pages. PDF pages are not of a
+  // fixed size; the threads only draw the problems of the tests, and the pages
+  // are then written out from their answer keys.
+  size_t max_test_size = 0;
+  size_t max_problems_per_test = 0;
+  for (int p = 0; p < num_parts; p++) {
+    max_test_size = std::max(max_test_size, setups[p]->test_size());
+    max_problems_per_test = std::max(max_problems_per_test,
+                                     setups[p]->problems_per_test);
+  }
+  const int kTestsPerThread = output.streaming() ? 1 :
+      static_cast<int>(std::max<size_t>(1, std::min<size_t>(
+          64, (4 << 20) / max_test_size)));
+  const int kTestsPerChunk = kTestsPerThread * num_threads;
+  if (output.streaming()) {
+    output.Flush();
+  }
+  size_t packet_size = 0;
+  size_t packet_pages = 0;
+  for (int n = begin_test; n < end_test; n++) {
+    const ProblemSetup& setup = *setups[mixed ? test_parts[n] : 0];
+    packet_size += setup.test_size();
+    packet_pages += setup.num_pages();
+  }
+  if (pdf_output) {
+    pdf.Expect(packet_pages);
+  } else {
+    output.Expect(packet_size + strlen("\\end{document}"));
+  }
+  std::vector<Xoshiro256> test_rngs(kTestsPerChunk, Xoshiro256(packet.seed));
+  std::vector<ChunkTest> chunk(kTestsPerChunk);
+
+  // Without repeats, the tests take consecutive problems from a deck (one per
+  // part) which is dealt anew (see ShuffleDeck) whenever it runs out. This is
+  // sequential, so the current thread deals the problems of a whole chunk up
+  // front and the threads only render them. Otherwise each thread samples from
+  // copies of the pools of its own.
+  std::vector<ProblemSet> decks;
+  std::vector<size_t> deck_positions;
+  std::vector<uint64_t> deck_passes;  // Next pass through each deck
+  if (render_pool_.get() == NULL) {
+    render_pool_.reset(new RenderPool(num_threads));
+  }
+  SampleWorkspace* workspaces = NULL;
+  std::vector<SampleWorkspace> dealt;
+  if (packet.no_repeat) {
+    // Problems of each part dealt before the first test created
+    std::vector<uint64_t> num_dealt(num_parts, 0);
+    for (int n = 0; mixed && n < begin_test; n++) {
+      num_dealt[test_parts[n]] += setups[test_parts[n]]->problems_per_test;
+    }
+    if (!mixed) {
+      num_dealt[0] = static_cast<uint64_t>(begin_test) *
+                     setups[0]->problems_per_test;
+    }
+
+    for (int p = 0; p < num_parts; p++) {
+      const ProblemSet& pool = setups[p]->problems;
+      decks.push_back(pool);
+      deck_passes.push_back(num_dealt[p] / pool.size());
+      deck_positions.push_back(pool.size());
+      if (num_dealt[p] % pool.size() != 0) {
+        ShuffleDeck(&decks[p], pool, packet.seed, p, deck_passes[p]++);
+        deck_positions[p] = num_dealt[p] % pool.size();
+      }
+    }
+    dealt.resize(kTestsPerChunk);
+    for (int test = 0; test < kTestsPerChunk; test++) {
+      dealt[test].pool.first.resize(max_problems_per_test);
+      dealt[test].pool.second.resize(max_problems_per_test);
+      dealt[test].pool.answer.resize(max_problems_per_test);
+    }
+  } else {
+    workspaces = render_pool_->Workspaces(&setups[0], num_parts);
+  }
+
+  // With past results, each test draws its problems by weight from the pool
+  // of its part, with replacement
+  std::vector<AliasTable> alias_tables;
+  if (packet.results != NULL) {
+    ScopedTimer timer(Stats::kSetup);
+    alias_tables.resize(num_parts);
+    std::vector<double> weights;
+    for (int p = 0; p < num_parts; p++) {
+      const ProblemSet& problems = setups[p]->problems;
+      const Operation operation = mixed ? packet.mix[p].operation :
+                                          packet.operation;
+      weights.resize(problems.size());
+      for (size_t k = 0; k < problems.size(); k++) {
+        weights[k] = packet.results->Weight(operation, problems.first[k],
+                                            problems.second[k]);
+      }
+      alias_tables[p].Build(weights);
+    }
+  }
+
+  // Fingerprints of the tests so far
+  FingerprintSet packet_fingerprints;
+  FingerprintSet* fingerprints = NULL;
+  if (packet.unique) {
+    fingerprints = options.fingerprints != NULL ? options.fingerprints :
+                   &packet_fingerprints;
+  }
+  repeated_tests_ = 0;
+
+  // Answer key: the threads record the problems of each test of the chunk
+  // (which are also needed for the pages of PDF output and fingerprinting)
+  std::vector<AnswerKeyRecord> keys;
+  if (key_output != NULL || pdf_output || fingerprints != NULL) {
+    keys.resize(kTestsPerChunk * max_problems_per_test);
+  }
+  if (key_output != NULL) {
+    if (key_format == kBinaryAnswerKey) {
+      AnswerKeyHeader header;
+      memcpy(header.magic, "ATKY", 4);
+      header.version = (mixed ? 2 : 1) + (selected ? 2 : 0);
+      header.operation = mixed ? 0 : setups[0]->name;
+      header.reserved = 0;
+      header.num_tests = end_test - begin_test;
+      header.problems_per_test = mixed ? 0 : static_cast<uint32_t>(
+          setups[0]->problems_per_test);
+      key_output->Write(reinterpret_cast<const char*>(&header),
+                        sizeof(header));
+      if (selected) {
+        AnswerKeySelection selection = {
+            static_cast<uint32_t>(begin_test + 1), 0};
+        key_output->Write(reinterpret_cast<const char*>(&selection),
+                          sizeof(selection));
+      }
+      for (int n = begin_test; mixed && n < end_test; n++) {
+        const ProblemSetup& setup = *setups[test_parts[n]];
+        AnswerKeyTest test = {setup.name, {0, 0, 0}, static_cast<uint32_t>(
+                                  setup.problems_per_test)};
+        key_output->Write(reinterpret_cast<const char*>(&test), sizeof(test));
+      }
+    } else if (mixed) {
+      *key_output << "test,page,problem,operation,first,second,answer\n";
+    } else {
+      *key_output << "test,page,problem,first,second,answer\n";
+    }
+  }
+
+  for (int n = begin_test; n < end_test; n += kTestsPerChunk) {
+    int num_chunk_tests = std::min(kTestsPerChunk, end_test - n);
+    int num_workers = std::min(num_threads, num_chunk_tests);
+
+    // Lay out the tests of the chunk back to back
+    size_t chunk_size = 0;
+    size_t chunk_key_size = 0;
+    for (int test = 0; test < num_chunk_tests; test++) {
+      ChunkTest& slot = chunk[test];
+      slot.part = mixed ? test_parts[n + test] : 0;
+      slot.offset = chunk_size;
+      slot.key_offset = chunk_key_size;
+      slot.first_page = next_page;
+      const ProblemSetup& setup = *setups[slot.part];
+      chunk_size += setup.test_size();
+      chunk_key_size += setup.problems_per_test;
+      next_page += static_cast<int>(setup.num_pages());
+    }
+    char* tests = pdf_output ? NULL : output.Reserve(chunk_size);
+
+    if (packet.no_repeat) {
+      // Deal the problems of each test to the thread rendering it
+      ScopedTimer timer(Stats::kShuffle);
+      for (int test = 0; test < num_chunk_tests; test++) {
+        const int part = chunk[test].part;
+        ProblemSet& deck = decks[part];
+        size_t& deck_position = deck_positions[part];
+        ProblemSet& drawn = dealt[test].pool;
+        for (size_t k = 0; k < setups[part]->problems_per_test; k++) {
+          if (deck_position == deck.size()) {
+            ShuffleDeck(&deck, setups[part]->problems, packet.seed, part,
+                        deck_passes[part]++);
+            deck_position = 0;
+          }
+          drawn.first[k] = deck.first[deck_position];
+          drawn.second[k] = deck.second[deck_position];
+          drawn.answer[k] = deck.answer[deck_position];
+          deck_position++;
+        }
+      }
+    } else {
+      // Set up the stream of each test of the chunk, past the draw of the
+      // part of the test
+      for (int test = 0; test < num_chunk_tests; test++) {
+        test_rngs[test] = Xoshiro256(packet.seed, n + test);
+        if (mixed) {
+          DrawPart(test_rngs[test], weight_sums);
+        }
+      }
+    }
+
+    // Thread t renders tests t, t + num_workers, t + 2 * num_workers, ... of
+    // the chunk; the current thread takes the first share
+    AnswerKeyRecord* chunk_keys = keys.empty() ? NULL : &keys[0];
+    ChunkTask task;
+    task.tests = tests;
+    task.setups = &setups[0];
+    task.chunk = &chunk[0];
+    task.test_rngs = packet.no_repeat ? NULL : &test_rngs[0];
+    task.alias_tables = alias_tables.empty() ? NULL : &alias_tables[0];
+    task.workspaces = workspaces;
+    task.num_parts = num_parts;
+    task.dealt = packet.no_repeat ? &dealt[0] : NULL;
+    task.keys = chunk_keys;
+    task.num_tests = num_chunk_tests;
+    render_pool_->Run(task, num_workers);
+
+    // Redraw (and render again) the tests which repeat an earlier test; the
+    // stream of a test continues where its previous draw left off
+    if (fingerprints != NULL) {
+      for (int test = 0; test < num_chunk_tests; test++) {
+        const ChunkTest& slot = chunk[test];
+        const ProblemSetup& setup = *setups[slot.part];
+        AnswerKeyRecord* test_keys = chunk_keys + slot.key_offset;
+        for (int attempt = 0; !fingerprints->Insert(TestFingerprint(
+                 setup.name, test_keys, setup.problems_per_test));
+             attempt++) {
+          if (attempt == kMaxUniqueAttempts) {
+            repeated_tests_++;
+            break;
+          }
+          RenderTest(tests ? tests + slot.offset : NULL, setup,
+                     &test_rngs[test],
+                     alias_tables.empty() ? NULL : &alias_tables[slot.part],
+                     &workspaces[slot.part], test_keys);
+        }
+      }
+    }
+
+    if (pdf_output) {
+      ScopedTimer timer(Stats::kRender);
+      for (int test = 0; test < num_chunk_tests; test++) {
+        const ChunkTest& slot = chunk[test];
+        const ProblemSetup& setup = *setups[slot.part];
+        const size_t problems_per_test = setup.problems_per_test;
+        const int num_pages = static_cast<int>(setup.num_pages());
+        for (int page = 0; page < num_pages; page++) {
+          size_t begin = page * kProblemsPerPage;
+          WritePdfProblemPage(
+              pdf, &pdf_layouts[slot.part],
+              chunk_keys + slot.key_offset + begin,
+              std::min<size_t>(kProblemsPerPage, problems_per_test - begin),
+              false, slot.first_page + page);
+        }
+      }
+    }
+    if (key_output != NULL) {
+      WriteAnswerKeys(*key_output, key_format, chunk_keys, n, num_chunk_tests,
+                      &setups[0], &chunk[0], mixed);
+    }
+
+    if (output.streaming()) {
+      output.Flush();
+    }
+
+    // Once the output cannot be written (e.g. the client of a socket is gone),
+    // the rest of the packet would go nowhere
+    if (output.failed() || (key_output != NULL && key_output->failed())) {
+      return false;
+    }
+  }
+
+  // Document end
+  if (pdf_output) {
+    pdf.Finish();
+  } else {
+    output << "\\end{document}";
+  }
+
+  return true;
+}
+
+// Write the preamble of a packet
+void WritePreamble(OutputBuffer& output) {
+  output << "\\documentclass[12pt, letterpaper]{article}\n";
+  output << "\\usepackage[margin=1in]{geometry}\n";
+  output << "\\usepackage{multicol}\n";
+  output << "\\usepackage{setspace}\n";
+  output << "\\usepackage{fancyhdr}\n";
+  output << "\\pagestyle{fancy}\n";
+  output << "\\renewcommand{\\headrulewidth}{0pt}\n";
+  output << "\\fancyhf{}\n";
+}
+
+// Write the preface of a packet: preamble, score tracker and the solutions
+// pages of the whole problem pool of each of setups (the operations of the
+// packet)
+void WritePreface(OutputBuffer& output,
+                  const std::vector<const ProblemSetup*>& setups,
+                  int num_tests) {
+  WritePreamble(output);
+
+  // Document begin
+  // First page(s) is(are) a scoring tracker, next page(s) is(are) solutions,
+  // and all following pages are tests
+  output << "\\begin{document}\n";
+  WriteScoreTracker(output, num_tests);
+
+  // Solutions pages: the whole pool in order
+  {
+    ScopedTimer timer(Stats::kRender);
+    for (size_t p = 0; p < setups.size(); p++) {
+      const ProblemSet& problems = setups[p]->problems;
+      for (size_t begin = 0; begin < problems.size();
+           begin += kProblemsPerPage) {
+        setups[p]->make_test_page(
+            output, problems, begin,
+            std::min(begin + kProblemsPerPage, problems.size()), true);
+      }
+    }
+  }
+
+  // Now that the preface pages are done, set up page numbering to apply to the
+  // test pages
+  output << "\\setcounter{page}{1}\n";
+  output << "\\lfoot{\\framebox{\\makebox[\\totalheight]{\\thepage}}}\n";
+}
+
+// Write the preface of the selected tests of a packet: just the preamble, with
+// the pages numbered from first_page on (the page of the first selected test
+// in the full packet)
+void WriteSelectedPreface(OutputBuffer& output, int first_page) {
+  WritePreamble(output);
+  output << "\\begin{document}\n";
+  output << "\\setcounter{page}{" << first_page << "}\n";
+  output << "\\lfoot{\\framebox{\\makebox[\\totalheight]{\\thepage}}}\n";
+}
+
+// Write the preface of a packet (see WritePreface) from the cache in
+// cache_dir, creating the cache entry first if needed. Entries are keyed by
+// operations, operand ranges and number of tests, and are stored by renaming a
+// complete temporary file, so concurrent runs never see a partial entry. If the
+// cache cannot be written or read, the preface is still written to output, and
+// false is returned with the reason in warning.
+bool WriteCachedPreface(OutputBuffer& output, const PacketRequest& packet,
+                        const std::vector<const ProblemSetup*>& setups,
+                        const std::string& cache_dir, std::string* warning) {
+  std::ostringstream name;
+  name << cache_dir << "/preface-v1-";
+  for (size_t p = 0; p < setups.size(); p++) {
+    name << setups[p]->name;
+  }
+  name << "-";
+  name << packet.first_range.low << "-" << packet.first_range.high << "-";
+  name << packet.second_range.low << "-" << packet.second_range.high << "-";
+  name << packet.num_tests << ".tex";
+  const std::string cache_file = name.str();
+
+  // Cache miss: create the entry first (unless another run has already)
+  std::ifstream cache_in(cache_file.c_str(), std::ios::binary);
+  if (!cache_in.is_open()) {
+    // The cache directory is created on first use (an existing one is fine)
+    mkdir(cache_dir.c_str(), 0777);
+    std::ostringstream temp_name;
+    temp_name << cache_file << ".tmp" << getpid() << "-"
+              << std::this_thread::get_id();
+    const std::string temp_file = temp_name.str();
+    std::ofstream cache_out(temp_file.c_str(), std::ios::binary);
+    {
+      OutputBuffer cache_output(cache_out, 1 << 20);
+      WritePreface(cache_output, setups, packet.num_tests);
+    }
+    cache_out.close();
+    if (!cache_out || rename(temp_file.c_str(), cache_file.c_str()) != 0) {
+      *warning = "unable to store the preface cache file " + cache_file;
+      unlink(temp_file.c_str());
+      WritePreface(output, setups, packet.num_tests);
+
+      return false;
+    }
+    cache_in.open(cache_file.c_str(), std::ios::binary);
+  }
+
+  // Cache hit: the file is read straight into the output; if it cannot be
+  // read after all, the preface is created instead
+  ScopedTimer timer(Stats::kSetup);
+  struct stat cache_info;
+  if (stat(cache_file.c_str(), &cache_info) == 0 &&
+      S_ISREG(cache_info.st_mode) && cache_info.st_size > 0) {
+    const size_t size = static_cast<size_t>(cache_info.st_size);
+    char* preface = output.Reserve(size);
+    if (cache_in.read(preface, size)) {
+      return true;
+    }
+    output.Unreserve(size);
+  }
+  *warning = "unable to read the preface cache file " + cache_file;
+  WritePreface(output, setups, packet.num_tests);
+
+  return false;
+}
+
+// Write the answer keys of the num_tests tests of a chunk, starting with test
+// first_test of the packet; keys holds the records of each test of the chunk
+// (see ChunkTest), and the tests of a mixed packet also list their operation
+// in CSV
+void WriteAnswerKeys(OutputBuffer& key_output, AnswerKeyFormat key_format,
+                     const AnswerKeyRecord* keys, int first_test,
+                     int num_tests, const ProblemSetup* const* setups,
+                     const ChunkTest* chunk, bool mixed) {
+  if (key_format == kBinaryAnswerKey) {
+    const ChunkTest& last = chunk[num_tests - 1];
+    const size_t num_records = last.key_offset +
+                               setups[last.part]->problems_per_test;
+    key_output.Write(reinterpret_cast<const char*>(keys),
+                     num_records * sizeof(AnswerKeyRecord));
+
+    return;
+  }
+
+  // CSV: tests, test pages (as numbered in the packet) and problems count from
+  // 1
+  ScopedTimer timer(Stats::kRender);
+  for (int n = 0; n < num_tests; n++) {
+    const int test = first_test + n;
+    const ChunkTest& slot = chunk[n];
+    const ProblemSetup& setup = *setups[slot.part];
+    for (size_t k = 0; k < setup.problems_per_test; k++) {
+      const AnswerKeyRecord& key = keys[slot.key_offset + k];
+      key_output << test + 1 << ',';
+      key_output << slot.first_page + static_cast<int>(k / kProblemsPerPage)
+                 << ',';
+      key_output << static_cast<int>(k + 1) << ',';
+      if (mixed) {
+        key_output << setup.name << ',';
+      }
+      key_output << key.first << ',' << key.second << ',' << key.answer;
+      key_output << '\n';
+    }
+  }
+}
+
+// Set up the problem pool of an operation and its test page templates
+template <typename Op>
+ProblemSetup::ProblemSetup(OperandRange first_range, OperandRange second_range,
+                           size_t problems_per_test, Op) {
+  ScopedTimer timer(Stats::kSetup);
+  name = Op::kName;
+  pdf_glyph = Op::PdfGlyph();
+  make_test_page = &MakeTestPage<Op>;
+  BuildProblemSet<Op>(first_range, second_range, &problems);
+  this->problems_per_test = problems_per_test > 0 ? problems_per_test :
+                                                    problems.size();
+
+  // Size the operand slots to fit the widest operands of the pool
+  int max_first = 0;
+  int max_second = 0;
+  for (size_t k = 0; k < problems.size(); k++) {
+    max_first = std::max<int>(max_first, problems.first[k]);
+    max_second = std::max<int>(max_second, problems.second[k]);
+  }
+  int first_width = 1;
+  for (; max_first >= 10; max_first /= 10) {
+    first_width++;
+  }
+  int second_width = 1;
+  for (; max_second >= 10; max_second /= 10) {
+    second_width++;
+  }
+
+  // All tests share the same markup; prepare it once
+  full_page = BuildPageTemplate<Op>(
+      std::min<size_t>(kProblemsPerPage, this->problems_per_test),
+      first_width, second_width);
+  last_page = BuildPageTemplate<Op>(
+      this->problems_per_test - (num_pages() - 1) * kProblemsPerPage,
+      first_width, second_width);
+}
+
+// Set up the problem pool for the given operation, ranges and problems per
+// test on first use, and return the shared instance afterwards (the instances
+// are kept until exit)
+template <typename Op>
+const ProblemSetup& ProblemSetup::Get(OperandRange first_range,
+                                      OperandRange second_range,
+                                      size_t problems_per_test) {
+  static std::mutex mutex;
+  static std::map<uint64_t, const ProblemSetup*> setups;
+
+  // The range bounds are at most kMaxOperand (10 bits)
+  const uint64_t key = ((static_cast<uint64_t>(problems_per_test) << 40) |
+                        (static_cast<uint64_t>(first_range.low) << 30) |
+                        (static_cast<uint64_t>(first_range.high) << 20) |
+                        (static_cast<uint64_t>(second_range.low) << 10) |
+                        static_cast<uint64_t>(second_range.high));
+  std::lock_guard<std::mutex> lock(mutex);
+  const ProblemSetup*& setup = setups[key];
+  if (setup == NULL) {
+    setup = new ProblemSetup(first_range, second_range, problems_per_test,
+                             Op());
+  }
+
+  return *setup;
+}
+
+const ProblemSetup& ProblemSetup::Get(Operation operation,
+                                      OperandRange first_range,
+                                      OperandRange second_range,
+                                      size_t problems_per_test) {
+  switch (operation) {
+  case kMultiplication:
+    return Get<Multiplication>(first_range, second_range, problems_per_test);
+  case kSubtraction:
+    return Get<Subtraction>(first_range, second_range, problems_per_test);
+  case kDivision:
+    return Get<Division>(first_range, second_range, problems_per_test);
+  case kAddition:
+  default:
+    return Get<Addition>(first_range, second_range, problems_per_test);
+  }
+}
+
+ProblemSetup* ProblemSetup::Create(Operation operation,
+                                   OperandRange first_range,
+                                   OperandRange second_range,
+                                   size_t problems_per_test) {
+  switch (operation) {
+  case kMultiplication:
+    return new ProblemSetup(first_range, second_range, problems_per_test,
+                            Multiplication());
+  case kSubtraction:
+    return new ProblemSetup(first_range, second_range, problems_per_test,
+                            Subtraction());
+  case kDivision:
+    return new ProblemSetup(first_range, second_range, problems_per_test,
+                            Division());
+  case kAddition:
+  default:
+    return new ProblemSetup(first_range, second_range, problems_per_test,
+                            Addition());
+  }
+}
+
+size_t ProblemSetup::num_pages() const {
+  return std::max<size_t>(1, (problems_per_test + kProblemsPerPage - 1) /
+                             kProblemsPerPage);
+}
+
+size_t ProblemSetup::test_size() const {
+  return (num_pages() - 1) * full_page.skeleton.size() +
+         last_page.skeleton.size();
+}
+
+// Score-tracking page(s): one line per test to record the time taken and the
+// number of problems correct. A page fits 60 records (two columns of 30).
+void WriteScoreTracker(OutputBuffer& output, int num_tests) {
+  ScopedTimer timer(Stats::kRender);
+  const int kRecordsPerPage = 60;
+
+  // Number of digits needed to display the number of tests included
+  int num_digits_needed = 1;
+  for (int max_m = num_tests; max_m >= 10; max_m /= 10) {
+    num_digits_needed++;
+  }
+
+  // Record numbers with fewer digits are padded with phantom zeros so that the
+  // records line up; prepare each required padding once
+  std::vector<std::string> paddings(num_digits_needed);
+  for (int num_zeros = 1; num_zeros < num_digits_needed; num_zeros++) {
+    paddings[num_zeros] = "\\phantom{" + std::string(num_zeros, '0') + "}";
+  }
+
+  int num_digits_curr_m = 1;
+  int next_power_of_ten = 10;
+  for (int m = 1; m < num_tests + 1; m++) {
+    if (m == next_power_of_ten) {
+      // Compare against num_tests first so that the power of ten cannot
+      // overflow
+      num_digits_curr_m++;
+      next_power_of_ten = next_power_of_ten > num_tests / 10 ?
+                          num_tests + 1 : next_power_of_ten * 10;
+    }
+
+    // Start a new page every kRecordsPerPage records
+    if (m % kRecordsPerPage == 1) {
+      output << "\\begin{multicols}{2}\n";
+      output << "\\setlength{\\columnseprule}{0.5pt}\n";
+      output << "{\\setstretch{1.5}\n";
+      output << "\\noindent\n";
+    }
+
+    // Output score tracking lines for each test that will be generated
+    output << paddings[num_digits_needed - num_digits_curr_m];
+    output << m << ". Time: \\underline{\\hspace{6em}}";
+    output << "\\quad Correct: \\underline{\\hspace{3em}}";
+    if (m == num_tests || m % kRecordsPerPage == 0) {
+      output << "\\par\n";
+      output << "}\n"; // Closing \setstretch
+      output << "\\end{multicols}\n";
+      output << "\\newpage\n";
+    } else {
+      output << "\\\\\n";
+    }
+  }
+}
+
+// PDF page geometry in points: US letter with 1in margins, set in 12pt
+// Helvetica, following the LaTeX layout
+const double kPdfPageWidth = 612;
+const double kPdfPageHeight = 792;
+const double kPdfMargin = 72;
+const double kPdfFontSize = 12;
+const double kPdfTopBaseline = kPdfPageHeight - kPdfMargin - kPdfFontSize;
+
+// Append a non-negative coordinate or length to PDF content, with two decimals
+// (formatted by hand, since this is the bulk of the page content)
+static void AppendPdfNumber(std::string* content, double value) {
+  unsigned int hundredths = static_cast<unsigned int>(value * 100 + 0.5);
+  char number[32];
+  char* end = number + sizeof(number);
+  end[-1] = ' ';
+  memcpy(end - 3, kDigitTable.text[100 + hundredths % 100] + 2, 2);  // "0d"
+  end[-4] = '.';
+  char* begin = FormatNumber(end - 4, hundredths / 100);
+  content->append(begin, end - begin);
+}
+
+// Append text set at (x, y) to PDF content (inside BT/ET); text must not need
+// escaping
+static void AppendPdfText(std::string* content, double x, double y,
+                          const char* text) {
+  *content += "1 0 0 1 ";
+  AppendPdfNumber(content, x);
+  AppendPdfNumber(content, y);
+  *content += "Tm (";
+  *content += text;
+  *content += ") Tj\n";
+}
+
+// Append a horizontal line from (x, y) to (x + width, y) to PDF content
+static void AppendPdfLine(std::string* content, double x, double y,
+                          double width) {
+  AppendPdfNumber(content, x);
+  AppendPdfNumber(content, y);
+  *content += "m ";
+  AppendPdfNumber(content, x + width);
+  AppendPdfNumber(content, y);
+  *content += "l\n";
+}
+
+// Width of text set in Helvetica at kPdfFontSize (WinAnsi encoding)
+double PdfTextWidth(const char* text, size_t length) {
+  // Advance widths of the printable ASCII characters (' ' to '~') in
+  // thousandths of the font size, from the Helvetica AFM
+  static const short kWidths[95] = {
+    278, 278, 355, 556, 556, 889, 667, 191, 333, 333, 389, 584, 278, 333, 278,
+    278, 556, 556, 556, 556, 556, 556, 556, 556, 556, 556, 278, 278, 584, 584,
+    584, 556, 1015, 667, 667, 722, 722, 667, 611, 778, 722, 278, 500, 667, 556,
+    833, 722, 778, 667, 778, 722, 667, 611, 722, 667, 944, 667, 667, 611, 278,
+    278, 278, 469, 556, 333, 556, 556, 500, 556, 556, 278, 556, 556, 222, 222,
+    500, 222, 833, 556, 556, 556, 556, 333, 500, 278, 556, 500, 722, 500, 500,
+    500, 334, 260, 334, 584
+  };
+
+  int width = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char character = static_cast<unsigned char>(text[i]);
+    if (character >= ' ' && character <= '~') {
+      width += kWidths[character - ' '];
+    } else {
+      // Multiplication and division signs
+      width += 584;
+    }
+  }
+
+  return width * kPdfFontSize / 1000;
+}
+
+// PDF version of WriteScoreTracker: two columns of 30 records per page,
+// separated by a rule, with the record numbers aligned on the right
+void WritePdfScoreTracker(PdfWriter& pdf, int num_tests) {
+  ScopedTimer timer(Stats::kRender);
+  const int kRecordsPerPage = 60;
+  const double kLineSkip = 21.5;  // 1.5 line spacing
+  const double kColumnSep = 20;
+  const double column_width = (kPdfPageWidth - 2 * kPdfMargin - kColumnSep) /
+                              2;
+
+  // Record layout: "N. Time: ______ Correct: ___", the time line shrinking
+  // if needed so that records with many digits still fit the column
+  int num_digits_needed = 1;
+  for (int max_m = num_tests; max_m >= 10; max_m /= 10) {
+    num_digits_needed++;
+  }
+  const double digit_width = PdfTextWidth("0", 1);
+  const double time_width = PdfTextWidth(". Time: ", 8);
+  const double correct_width = PdfTextWidth("Correct: ", 9);
+  const double correct_line = 3 * kPdfFontSize;
+  const double time_line = std::max(
+      kPdfFontSize, std::min(6 * kPdfFontSize,
+                             column_width - num_digits_needed * digit_width -
+                             time_width - kPdfFontSize - correct_width -
+                             correct_line));
+
+  // The content of each page is built in the same (cleared) strings
+  pdf.Expect((num_tests + kRecordsPerPage - 1) / kRecordsPerPage);
+  std::string text;
+  std::string lines;
+  for (int first = 1; first <= num_tests; first += kRecordsPerPage) {
+    int num_records = std::min(kRecordsPerPage, num_tests - first + 1);
+    int num_rows = (num_records + 1) / 2;  // Balanced columns
+    text.assign("BT /F1 12 Tf\n");
+    lines.assign("0.5 w\n");
+    for (int r = 0; r < num_records; r++) {
+      int m = first + r;
+      double x = kPdfMargin + (r / num_rows) * (column_width + kColumnSep);
+      double y = kPdfTopBaseline - (r % num_rows) * kLineSkip;
+
+      char label[32];
+      char* label_begin = FormatNumber(label + 16, m);
+      memcpy(label + 16, ". Time:", 8);
+      int num_digits = static_cast<int>(label + 16 - label_begin);
+      x += (num_digits_needed - num_digits) * digit_width;
+      AppendPdfText(&text, x, y, label_begin);
+      x += num_digits * digit_width + time_width;
+      AppendPdfLine(&lines, x, y - 2, time_line);
+      x += time_line + kPdfFontSize;
+      AppendPdfText(&text, x, y, "Correct:");
+      x += correct_width;
+      AppendPdfLine(&lines, x, y - 2, correct_line);
+    }
+    text += "ET\n";
+
+    // Column rule
+    if (num_records > num_rows) {
+      AppendPdfNumber(&lines, kPdfPageWidth / 2);
+      AppendPdfNumber(&lines, kPdfTopBaseline + kPdfFontSize);
+      lines += "m ";
+      AppendPdfNumber(&lines, kPdfPageWidth / 2);
+      AppendPdfNumber(&lines, kPdfTopBaseline - (num_rows - 1) * kLineSkip -
+                              kPdfFontSize / 2);
+      lines += "l\n";
+    }
+    lines += "S\n";
+
+    text += lines;
+    int stream = pdf.AddStream(text);
+    pdf.AddPage(&stream, 1);
+  }
+}
+
+// Write one page of num_problems problems (see MakeTestPage for the layout),
+// possibly with solutions. Test pages (page_number > 0) get a framed page
+// number in the left footer.
+void WritePdfProblemPage(PdfWriter& pdf, PdfProblemLayout* layout,
+                         const AnswerKeyRecord* problems, size_t num_problems,
+                         bool include_solutions, int page_number) {
+  const double kColumnPitch = (kPdfPageWidth - 2 * kPdfMargin) /
+                              kProblemsPerRow;
+  const double kLineSkip = 15;
+  const double kRowSkip = 4 * kLineSkip;
+  const double glyph_width = PdfTextWidth(layout->glyph.data(),
+                                          layout->glyph.size());
+  const double space_width = PdfTextWidth(" ", 1);
+  const double cell_width = std::max(layout->first_width,
+                                     glyph_width + space_width +
+                                     layout->second_width);
+
+  // Operators and rules: shared by all pages with this number of problems
+  int& grid = layout->grids[num_problems];
+  if (grid == 0) {
+    std::string text = "BT /F1 12 Tf\n";
+    std::string lines = "0.4 w\n";
+    for (size_t k = 0; k < num_problems; k++) {
+      double right = kPdfMargin + (k % kProblemsPerRow) * kColumnPitch +
+                     cell_width;
+      double y = kPdfTopBaseline - (k / kProblemsPerRow) * kRowSkip;
+      AppendPdfText(&text, right - layout->second_width - space_width -
+                           glyph_width, y - kLineSkip, layout->glyph.c_str());
+      AppendPdfLine(&lines, right - cell_width, y - kLineSkip - 4,
+                    cell_width);
+    }
+    text += "ET\n";
+    lines += "S\n";
+    grid = pdf.AddStream(text + lines);
+  }
+
+  // Operands (and answers), right-aligned
+  std::string& content = layout->content;
+  content.assign("BT /F1 12 Tf\n");
+  char digits[24];
+  char* digits_end = digits + sizeof(digits) - 1;
+  *digits_end = '\0';
+  for (size_t k = 0; k < num_problems; k++) {
+    double right = kPdfMargin + (k % kProblemsPerRow) * kColumnPitch +
+                   cell_width;
+    double y = kPdfTopBaseline - (k / kProblemsPerRow) * kRowSkip;
+    const char* number = FormatNumber(digits_end, problems[k].first);
+    AppendPdfText(&content, right - PdfTextWidth(number, digits_end - number),
+                  y, number);
+    number = FormatNumber(digits_end, problems[k].second);
+    AppendPdfText(&content, right - PdfTextWidth(number, digits_end - number),
+                  y - kLineSkip, number);
+    if (include_solutions) {
+      number = FormatNumber(digits_end, problems[k].answer);
+      AppendPdfText(&content,
+                    right - PdfTextWidth(number, digits_end - number),
+                    y - 2 * kLineSkip, number);
+    }
+  }
+
+  // Framed page number in the left footer
+  const double kFooterBaseline = kPdfMargin - 30;
+  const double kBoxSize = 16;
+  if (page_number > 0) {
+    const char* number = FormatNumber(digits_end, page_number);
+    AppendPdfText(&content, kPdfMargin + (kBoxSize -
+                            PdfTextWidth(number, digits_end - number)) / 2,
+                  kFooterBaseline, number);
+  }
+  content += "ET\n";
+  if (page_number > 0) {
+    content += "0.4 w ";
+    AppendPdfNumber(&content, kPdfMargin);
+    AppendPdfNumber(&content, kFooterBaseline - 4.5);
+    AppendPdfNumber(&content, kBoxSize);
+    AppendPdfNumber(&content, kBoxSize);
+    content += "re S\n";
+  }
+
+  int streams[2] = {grid, pdf.AddStream(content)};
+  pdf.AddPage(streams, 2);
+}
+
+// Set up the pool of problems of an operation: every combination of an operand
+// value i from first_range (of the rows which the operation includes) and j
+// from second_range, in row order
+template <typename Op>
+void BuildProblemSet(OperandRange first_range, OperandRange second_range,
+                     ProblemSet* problems) {
+  const int num_second = second_range.high - second_range.low + 1;
+  size_t num_rows = 0;
+  for (int i = first_range.low; i <= first_range.high; i++) {
+    num_rows += Op::IncludeRow(i);
+  }
+  problems->first.resize(num_rows * num_second);
+  problems->second.resize(num_rows * num_second);
+  problems->answer.resize(num_rows * num_second);
+
+  size_t row = 0;
+  for (int i = first_range.low; i <= first_range.high; i++) {
+    if (Op::IncludeRow(i)) {
+      FillProblemRow<Op>(i, second_range.low, num_second,
+                         &problems->first[row], &problems->second[row],
+                         &problems->answer[row]);
+      row += num_second;
+    }
+  }
+}
+
+// Fill the problems of row i of the pool: operand values i and j, for j from
+// j_low to j_low + count - 1. The arrays are sized up front and do not overlap,
+// so this is a plain loop without branches, calls or divisions, which the
+// compiler turns into vector code (min/max for the subtraction swap, multiplies
+// for the products and dividends).
+template <typename Op>
+void FillProblemRow(int i, int j_low, int count, int16_t* __restrict__ first,
+                    int16_t* __restrict__ second, int32_t* __restrict__ answer) {
+  // Blocks of a fixed number of problems are vectorized even where the
+  // compiler does not vectorize loops of unknown length (e.g. GCC at -O2); the
+  // rest of the row is filled one problem at a time
+  const int kBlockSize = 8;
+  int n = 0;
+  for (; n + kBlockSize <= count; n += kBlockSize) {
+    for (int b = 0; b < kBlockSize; b++) {
+      const int j = j_low + n + b;
+      first[n + b] = static_cast<int16_t>(Op::First(i, j));
+      second[n + b] = static_cast<int16_t>(Op::Second(i, j));
+      answer[n + b] = Op::Answer(i, j);
+    }
+  }
+  for (; n < count; n++) {
+    const int j = j_low + n;
+    first[n] = static_cast<int16_t>(Op::First(i, j));
+    second[n] = static_cast<int16_t>(Op::Second(i, j));
+    answer[n] = Op::Answer(i, j);
+  }
+}
+
+// Generate a test page with problems begin..end - 1 of the pool, possibly with
+// solutions
+template <typename Op>
+void MakeTestPage(OutputBuffer& output_file, const ProblemSet& problems,
+                  size_t begin, size_t end, bool include_solutions) {
+  // Output LaTeX source for the arithmetic problems. The problems are laid out
+  // in rows of kProblemsPerRow problems, but each problem actually takes two
+  // rows (augend/multiplier/minued/dividend in one row,
+  // addend/multiplicand/subtrahend/divisor in the next), and there is an empty
+  // column between each problem for a grand total of 19 columns (= 10 problem
+  // columns + 9 empty columns) in the table.
+  output_file << "\\begin{tabular}{rrrrrrrrrrrrrrrrrrr}\n";
+
+  for (size_t row_begin = begin; row_begin < end;
+       row_begin += kProblemsPerRow) {
+    size_t row_end = std::min<size_t>(row_begin + kProblemsPerRow, end);
+
+    // Augend/Multiplier/Minued/Dividend row
+    for (size_t k = row_begin; k < row_end; k++) {
+      output_file << problems.first[k];
+      if (k == row_end - 1) {
+        // At the end of the row; add new row
+        output_file << "\\\\\n";
+      } else {
+        // Not at the end of the row; add column separators
+        output_file << " & & ";
+      }
+    }
+
+    // Addend/Multiplicand/Subtrahend/Divisor row
+    for (size_t k = row_begin; k < row_end; k++) {
+      // Output the operator and the addend/multiplicand/subtrahend/divisor
+      output_file << Op::Glyph() << problems.second[k];
+      if (k == row_end - 1) {
+        output_file << "\\\\\n";
+      } else {
+        output_file << " & & ";
+      }
+    }
+
+    // Add lines separating addends/multiplicands/subtrahends/divisors and
+    // sums/products/differences/quotients
+    for (size_t col = 0; col < row_end - row_begin; col++) {
+      output_file << "\\cline{" << static_cast<int>(2 * col + 1) << "-";
+      output_file << static_cast<int>(2 * col + 1) << "} ";
+    }
+
+    // Add solutions or empty row
+    // (blank space for writing in the sums/products/differences/quotients)
+    if (include_solutions) {
+      for (size_t k = row_begin; k < row_end; k++) {
+        // Sums/Products/Differences/Quotients row
+        output_file << problems.answer[k];
+
+        if (k == row_end - 1) {
+          // At the end of the row; add solution and new row
+          output_file << "\\\\ \\\\";
+        } else {
+          // Not at the end of the row; add column separators
+          output_file << " & & ";
+        }
+      }
+    } else {
+      output_file << "\\\\ \\\\";
+    }
+
+    // End the current line of LaTeX source
+    output_file << '\n';
+  }
+
+  // End of current table and page
+  output_file << "\\end{tabular}\n";
+  output_file << "\\newpage\n";
+}
+
+// Prepare the skeleton of a test page with num_problems problems (see
+// MakeTestPage for the layout); the operand slots are left blank
+template <typename Op>
+PageTemplate BuildPageTemplate(size_t num_problems, int first_width,
+                               int second_width) {
+  PageTemplate page_template;
+  page_template.first_width = first_width;
+  page_template.second_width = second_width;
+  page_template.slots.resize(num_problems);
+
+  std::string& skeleton = page_template.skeleton;
+  skeleton = "\\begin{tabular}{rrrrrrrrrrrrrrrrrrr}\n";
+  for (size_t row_begin = 0; row_begin < num_problems;
+       row_begin += kProblemsPerRow) {
+    size_t row_end = std::min<size_t>(row_begin + kProblemsPerRow,
+                                      num_problems);
+
+    // Augend/Multiplier/Minued/Dividend row
+    for (size_t k = row_begin; k < row_end; k++) {
+      page_template.slots[k].first = skeleton.size();
+      skeleton.append(first_width, ' ');
+      skeleton += k == row_end - 1 ? "\\\\\n" : " & & ";
+    }
+
+    // Addend/Multiplicand/Subtrahend/Divisor row
+    for (size_t k = row_begin; k < row_end; k++) {
+      skeleton += Op::Glyph();
+      page_template.slots[k].second = skeleton.size();
+      skeleton.append(second_width, ' ');
+      skeleton += k == row_end - 1 ? "\\\\\n" : " & & ";
+    }
+
+    // Lines separating the problems from the (blank) solutions row
+    for (size_t col = 0; col < row_end - row_begin; col++) {
+      std::ostringstream separator;
+      separator << "\\cline{" << 2 * col + 1 << "-" << 2 * col + 1 << "} ";
+      skeleton += separator.str();
+    }
+    skeleton += "\\\\ \\\\\n";
+  }
+
+  // End of current table and page
+  skeleton += "\\end{tabular}\n";
+  skeleton += "\\newpage\n";
+
+  return page_template;
+}
+
+DigitTable::DigitTable() {
+  for (int value = 0; value < 10000; value++) {
+    char* curr_digit = text[value] + 4;
+    int remaining = value;
+    do {
+      *--curr_digit = static_cast<char>('0' + remaining % 10);
+      remaining /= 10;
+    } while (remaining > 0);
+    length[value] = static_cast<uint8_t>(text[value] + 4 - curr_digit);
+    while (curr_digit > text[value]) {
+      *--curr_digit = ' ';
+    }
+  }
+}
+
+// Write the decimal digits of value so that they end right before end, four
+// digits at a time from kDigitTable, and return a pointer to the first digit
+// (there must be room for 20 digits before end)
+char* FormatNumber(char* end, uint64_t value) {
+  while (value >= 10000) {
+    const char* group = kDigitTable.text[value % 10000];
+    end -= 4;
+    for (int k = 0; k < 4; k++) {
+      end[k] = group[k] == ' ' ? '0' : group[k];  // Inner groups keep zeros
+    }
+    value /= 10000;
+  }
+  size_t length = kDigitTable.length[value];
+  end -= length;
+  memcpy(end, kDigitTable.text[value] + 4 - length, length);
+  return end;
+}
+
+// Write value right-aligned into the width characters at slot (which hold
+// spaces in the skeleton); value has at most width digits
+static void FillSlot(char* slot, int width, int value) {
+  if (width <= 4) {
+    // A fixed-width copy, including the leading spaces of the table entry
+    memcpy(slot, kDigitTable.text[value] + 4 - width, width);
+    return;
+  }
+  char digits[24];
+  char* digits_end = digits + sizeof(digits);
+  char* number = FormatNumber(digits_end, value);
+  memcpy(slot + width - (digits_end - number), number, digits_end - number);
+}
+
+// Generate a test page (without solutions) by patching the operands first[k]
+// and second[k] of its problems into a copy of the page template stored at
+// page
+void RenderTestPage(char* page, const PageTemplate& page_template,
+                    const int16_t* first, const int16_t* second) {
+  memcpy(page, page_template.skeleton.data(), page_template.skeleton.size());
+
+  const size_t num_problems = page_template.slots.size();
+  for (size_t k = 0; k < num_problems; k++) {
+    FillSlot(page + page_template.slots[k].first, page_template.first_width,
+             first[k]);
+    FillSlot(page + page_template.slots[k].second, page_template.second_width,
+             second[k]);
+  }
+}
+
+// Draw and render a test into the slot at test. With test_rng, the test is
+// sampled from the pool copy of workspace with that random number stream (or
+// drawn by weight from the pool with alias_table), so it only depends on its
+// own stream; without, its problems have already been drawn into workspace
+// (see SampleWorkspace). If keys is given, the problems and answers of the
+// test are also stored there; if test is NULL, that is all that is done.
+void RenderTest(char* test, const ProblemSetup& setup, Xoshiro256* test_rng,
+                const AliasTable* alias_table, SampleWorkspace* workspace,
+                AnswerKeyRecord* keys) {
+  const size_t problems_per_test = setup.problems_per_test;
+  const size_t full_page_size = setup.full_page.skeleton.size();
+  const size_t num_full_pages = setup.num_pages() - 1;
+  ProblemSet* pool = &workspace->pool;
+
+  // Randomly draw the problems of the test: the last problems_per_test
+  // problems of the pool copy after sampling, the ones drawn by weight, or
+  // the drawn ones
+  size_t drawn = 0;
+  if (alias_table != NULL) {
+    ScopedTimer timer(Stats::kShuffle);
+    const ProblemSet& problems = setup.problems;
+    pool = &workspace->weighted;
+    pool->first.resize(problems_per_test);
+    pool->second.resize(problems_per_test);
+    pool->answer.resize(problems_per_test);
+    for (size_t k = 0; k < problems_per_test; k++) {
+      const uint32_t problem = alias_table->Draw(*test_rng);
+      pool->first[k] = problems.first[problem];
+      pool->second[k] = problems.second[problem];
+      pool->answer[k] = problems.answer[problem];
+    }
+  } else if (test_rng != NULL) {
+    ScopedTimer timer(Stats::kShuffle);
+    SampleProblems(pool, problems_per_test, *test_rng, &workspace->swaps);
+    drawn = pool->size() - problems_per_test;
+  }
+  const int16_t* first = &pool->first[drawn];
+  const int16_t* second = &pool->second[drawn];
+
+  if (keys != NULL) {
+    for (size_t k = 0; k < problems_per_test; k++) {
+      keys[k].first = first[k];
+      keys[k].second = second[k];
+      keys[k].answer = pool->answer[drawn + k];
+    }
+  }
+
+  // Create the test pages
+  if (test != NULL) {
+    ScopedTimer timer(Stats::kRender);
+    for (size_t page = 0; page < num_full_pages; page++) {
+      RenderTestPage(test + page * full_page_size, setup.full_page,
+                     first + page * kProblemsPerPage,
+                     second + page * kProblemsPerPage);
+    }
+    RenderTestPage(test + num_full_pages * full_page_size, setup.last_page,
+                   first + num_full_pages * kProblemsPerPage,
+                   second + num_full_pages * kProblemsPerPage);
+  }
+
+  // Restore the pool copy for the next test
+  if (test_rng != NULL && alias_table == NULL) {
+    ScopedTimer timer(Stats::kShuffle);
+    UndoSample(pool, workspace->swaps);
+  }
+}
+
+// Draw and render tests first, first + step, first + 2 * step, ... of the
+// num_tests tests of a chunk (see RenderTest), each with the setup of its part
+// out of setups. With test_rngs, test n is sampled with test_rngs[n] from the
+// pool copy of its part out of workspaces (or drawn by weight with the alias
+// table of its part, if alias_tables is given); without, its problems have
+// been drawn into dealt[n]. tests and keys are the pages and answer key
+// records of the whole chunk, or NULL.
+void RenderChunk(char* tests, const ProblemSetup* const* setups,
+                 const ChunkTest* chunk, Xoshiro256* test_rngs,
+                 const AliasTable* alias_tables, SampleWorkspace* workspaces,
+                 SampleWorkspace* dealt, AnswerKeyRecord* keys, int first,
+                 int num_tests, int step) {
+  for (int n = first; n < num_tests; n += step) {
+    const ChunkTest& slot = chunk[n];
+    if (test_rngs != NULL) {
+      RenderTest(tests ? tests + slot.offset : NULL, *setups[slot.part],
+                 &test_rngs[n],
+                 alias_tables ? &alias_tables[slot.part] : NULL,
+                 &workspaces[slot.part], keys ? keys + slot.key_offset : NULL);
+    } else {
+      RenderTest(tests ? tests + slot.offset : NULL, *setups[slot.part], NULL,
+                 NULL, &dealt[n], keys ? keys + slot.key_offset : NULL);
+    }
+  }
+}
+
+RenderPool::RenderPool(int num_threads)
+    : task_(NULL), num_workers_(0), generation_(0), pending_(0),
+      stopping_(false) {
+  for (int t = 1; t < num_threads; t++) {
+    threads_.push_back(std::thread(&RenderPool::Work, this, t));
+  }
+}
+
+RenderPool::~RenderPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  started_.notify_all();
+  for (size_t t = 0; t < threads_.size(); t++) {
+    threads_[t].join();
+  }
+}
+
+SampleWorkspace* RenderPool::Workspaces(const ProblemSetup* const* setups,
+                                        int num_parts) {
+  const size_t num_workspaces = (threads_.size() + 1) * num_parts;
+  if (workspaces_.size() < num_workspaces) {
+    workspaces_.resize(num_workspaces);
+    workspace_setups_.resize(num_workspaces, NULL);
+  }
+
+  // The tests restore the pool copies they shuffle, so a copy of the same
+  // pool is as good as new
+  for (size_t w = 0; w < num_workspaces; w++) {
+    const ProblemSetup* setup = setups[w % num_parts];
+    if (workspace_setups_[w] != setup) {
+      workspaces_[w].pool = setup->problems;
+      workspace_setups_[w] = setup;
+    }
+  }
+
+  return &workspaces_[0];
+}
+
+void RenderPool::Run(const ChunkTask& task, int num_workers) {
+  if (num_workers > 1) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+      num_workers_ = num_workers;
+      pending_ = num_workers - 1;
+      generation_++;
+    }
+    started_.notify_all();
+  }
+
+  RenderChunk(task.tests, task.setups, task.chunk, task.test_rngs,
+              task.alias_tables, task.workspaces, task.dealt, task.keys, 0,
+              task.num_tests, num_workers);
+
+  if (num_workers > 1) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    finished_.wait(lock, [this] { return pending_ == 0; });
+  }
+}
+
+// A pool thread: render the share of thread of every task it takes part in
+void RenderPool::Work(int thread) {
+  uint64_t generation = 0;  // Last task seen
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    started_.wait(lock, [this, generation] {
+      return stopping_ || generation_ != generation;
+    });
+    if (stopping_) {
+      return;
+    }
+    generation = generation_;
+    if (thread >= num_workers_) {
+      continue;
+    }
+
+    const ChunkTask& task = *task_;
+    const int num_workers = num_workers_;
+    lock.unlock();
+    RenderChunk(task.tests, task.setups, task.chunk, task.test_rngs,
+                task.alias_tables,
+                task.workspaces ? task.workspaces + thread * task.num_parts :
+                                  NULL,
+                task.dealt, task.keys, thread, task.num_tests, num_workers);
+    lock.lock();
+    if (--pending_ == 0) {
+      finished_.notify_one();
+    }
+  }
+}
+
+// Set up the table for drawing problem k with probability weights[k] / (sum
+// of the weights); the weights are positive
+void AliasTable::Build(const std::vector<double>& weights) {
+  const size_t num_problems = weights.size();
+  double weight_sum = 0;
+  for (size_t k = 0; k < num_problems; k++) {
+    weight_sum += weights[k];
+  }
+
+  // Scale the weights to an average of 1; columns below 1 are topped up by an
+  // alias above 1, which then counts as below or above 1 with the rest
+  std::vector<double> scaled(num_problems);
+  std::vector<uint32_t> small;
+  std::vector<uint32_t> large;
+  for (size_t k = 0; k < num_problems; k++) {
+    scaled[k] = weights[k] * num_problems / weight_sum;
+    (scaled[k] < 1 ? small : large).push_back(static_cast<uint32_t>(k));
+  }
+  thresholds.assign(num_problems, UINT32_MAX);
+  aliases.resize(num_problems);
+  for (size_t k = 0; k < num_problems; k++) {
+    aliases[k] = static_cast<uint32_t>(k);
+  }
+  while (!small.empty() && !large.empty()) {
+    const uint32_t column = small.back();
+    const uint32_t alias = large.back();
+    small.pop_back();
+    large.pop_back();
+    thresholds[column] = static_cast<uint32_t>(scaled[column] * 4294967296.0);
+    aliases[column] = alias;
+    scaled[alias] = (scaled[alias] + scaled[column]) - 1;
+    (scaled[alias] < 1 ? small : large).push_back(alias);
+  }
+  // The columns left over are full (up to rounding)
+}
+
+// Random number in 0..bound - 1 without modulo bias (Lemire's multiply-shift
+// method on the upper 32 bits of the generator output)
+static inline uint32_t RandomBelow(Xoshiro256& rng, uint32_t bound) {
+  uint64_t product = (rng() >> 32) * bound;
+  uint32_t low_bits = static_cast<uint32_t>(product);
+  if (low_bits < bound) {
+    const uint32_t threshold = (0u - bound) % bound;
+    while (low_bits < threshold) {
+      product = (rng() >> 32) * bound;
+      low_bits = static_cast<uint32_t>(product);
+    }
+  }
+
+  return static_cast<uint32_t>(product >> 32);
+}
+
+// Swap problems a and b of a pool
+static inline void SwapProblems(ProblemSet* problems, size_t a, size_t b) {
+  std::swap(problems->first[a], problems->first[b]);
+  std::swap(problems->second[a], problems->second[b]);
+  std::swap(problems->answer[a], problems->answer[b]);
+}
+
+// Fisher-Yates shuffle of the problems of a pool, moving the operand and answer
+// arrays in lockstep
+void ShuffleProblems(ProblemSet* problems, Xoshiro256& rng) {
+  for (size_t k = problems->size(); k > 1; k--) {
+    SwapProblems(problems, k - 1, RandomBelow(rng, static_cast<uint32_t>(k)));
+  }
+}
+
+// Part of a test of a mixed packet, drawn by weight with the stream of the
+// test (as its first number); weight_sums holds the sums of the weights of the
+// parts up to each part
+int DrawPart(Xoshiro256& test_rng, const std::vector<uint32_t>& weight_sums) {
+  const uint32_t draw = RandomBelow(test_rng, weight_sums.back());
+
+  return static_cast<int>(
+      std::upper_bound(weight_sums.begin(), weight_sums.end(), draw) -
+      weight_sums.begin());
+}
+
+// Set deck to pass number pass through the pool of a part of a packet without
+// repeats: the pool shuffled with a stream of its own, so that any pass can be
+// set up directly
+void ShuffleDeck(ProblemSet* deck, const ProblemSet& pool, uint64_t seed,
+                 int part, uint64_t pass) {
+  *deck = pool;
+  Xoshiro256 deck_rng(seed, kDeckStreams + (static_cast<uint64_t>(part) << 32) +
+                            pass);
+  ShuffleProblems(deck, deck_rng);
+}
+
+// Partial Fisher-Yates shuffle: move a random sample of num_samples problems,
+// in random order, to the end of the pool. Only the last num_samples steps of
+// ShuffleProblems are made (so sampling the whole pool is the same as
+// shuffling it), and the swaps are recorded for UndoSample.
+void SampleProblems(ProblemSet* problems, size_t num_samples, Xoshiro256& rng,
+                    std::vector<uint32_t>* swaps) {
+  const size_t num_problems = problems->size();
+  swaps->clear();
+  for (size_t k = num_problems; k > num_problems - num_samples && k > 1; k--) {
+    uint32_t other = RandomBelow(rng, static_cast<uint32_t>(k));
+    SwapProblems(problems, k - 1, other);
+    swaps->push_back(other);
+  }
+}
+
+// Restore the pool order from before SampleProblems by undoing its swaps in
+// reverse
+void UndoSample(ProblemSet* problems, const std::vector<uint32_t>& swaps) {
+  size_t k = problems->size() - swaps.size() + 1;
+  for (size_t s = swaps.size(); s > 0; s--, k++) {
+    SwapProblems(problems, k - 1, swaps[s - 1]);
+  }
+}
+
+// Fingerprint of the problems of a test, in order, for the given test_type
+// character: a multiply-xorshift hash of the operands, finished with the
+// SplitMix64 mixing function
+uint64_t TestFingerprint(char operation, const AnswerKeyRecord* problems,
+                         size_t num_problems) {
+  uint64_t hash = 0x9e3779b97f4a7c15ULL * static_cast<uint8_t>(operation);
+  for (size_t k = 0; k < num_problems; k++) {
+    uint64_t operands = static_cast<uint16_t>(problems[k].first) << 16 |
+                        static_cast<uint16_t>(problems[k].second);
+    hash = (hash ^ operands) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+  }
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+
+  return hash ^ (hash >> 31);
+}
+
+// Mixing function of SplitMix64, which is one-to-one
+static inline uint64_t MixBits(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+  return z ^ (z >> 31);
+}
+
+// Next output of SplitMix64 with the given state
+static inline uint64_t SplitMix64(uint64_t* state) {
+  return MixBits(*state += 0x9e3779b97f4a7c15ULL);
+}
+
+// Seed the generator state with four consecutive outputs of SplitMix64
+Xoshiro256::Xoshiro256(uint64_t seed) {
+  for (int i = 0; i < 4; i++) {
+    state_[i] = SplitMix64(&seed);
+  }
+}
+
+// Every word of the state is SplitMix64 output started from the mixed seed and
+// stream, so the streams of a seed differ from their first output on (the
+// first output only depends on the second word). Both mixes are one-to-one,
+// so no two streams of a seed share a state.
+Xoshiro256::Xoshiro256(uint64_t seed, uint64_t stream) {
+  uint64_t stream_state = SplitMix64(&seed) ^ MixBits(stream);
+  for (int i = 0; i < 4; i++) {
+    state_[i] = SplitMix64(&stream_state);
+  }
+}
+
+static inline uint64_t RotateLeft(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+Xoshiro256::result_type Xoshiro256::operator()() {
+  const uint64_t result = RotateLeft(state_[1] * 5, 7) * 9;
+  const uint64_t t = state_[1] << 17;
+
+  state_[2] ^= state_[0];
+  state_[3] ^= state_[1];
+  state_[1] ^= state_[2];
+  state_[0] ^= state_[3];
+  state_[2] ^= t;
+  state_[3] = RotateLeft(state_[3], 45);
+
+  return result;
+}
+
+// Set up an output buffer which writes to the given stream in blocks of
+// block_size bytes
+OutputBuffer::OutputBuffer(std::ostream& output, size_t block_size,
+                           bool streaming)
+    : output_(&output), block_size_(block_size), streaming_(streaming),
+      fd_(-1), map_(NULL), map_size_(0), map_used_(0), map_failed_(false) {
+  buffer_.reserve(block_size_);
+}
+
+OutputBuffer::OutputBuffer(int fd)
+    : output_(NULL), block_size_(0), streaming_(false), fd_(fd), map_(NULL),
+      map_size_(0), map_used_(0), map_failed_(false) {
+}
+
+OutputBuffer::~OutputBuffer() {
+  if (fd_ >= 0) {
+    Close();
+  } else {
+    Flush();
+  }
+}
+
+void OutputBuffer::Expect(size_t length) {
+  if (fd_ >= 0 && !map_failed_ && map_used_ + length > map_size_) {
+    map_failed_ = !Map(map_used_ + length);
+  }
+}
+
+bool OutputBuffer::Close() {
+  if (fd_ < 0) {
+    return true;
+  }
+
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+    map_ = NULL;
+  }
+  if (!map_failed_ && ftruncate(fd_, map_used_) != 0) {
+    map_failed_ = true;
+  }
+  if (stats != NULL && !map_failed_) {
+    stats->bytes_written.fetch_add(map_used_, std::memory_order_relaxed);
+    stats->num_flushes.fetch_add(1, std::memory_order_relaxed);
+  }
+  fd_ = -1;
+  buffer_.clear();
+
+  return !map_failed_;
+}
+
+char* OutputBuffer::Extend(size_t length) {
+  if (!map_failed_ && map_used_ + length > map_size_) {
+    // Grow geometrically so that the file is remapped only a few times
+    map_failed_ = !Map(std::max(map_used_ + length, 2 * map_size_));
+  }
+  if (map_failed_) {
+    buffer_.resize(length);
+    return &buffer_[0];
+  }
+
+  char* data = map_ + map_used_;
+  map_used_ += length;
+  return data;
+}
+
+// Allocate at least map_size bytes on disk for the file (so that rendering
+// into the mapping cannot run out of space), and map all of it
+bool OutputBuffer::Map(size_t map_size) {
+  const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  map_size = (map_size + page_size - 1) / page_size * page_size;
+
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+    map_ = NULL;
+  }
+  int error = posix_fallocate(fd_, 0, map_size);
+  if (error != 0 && ftruncate(fd_, map_size) != 0) {
+    // Not all file systems support preallocation; a sparse file does too
+    return false;
+  }
+  void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  map_ = static_cast<char*>(map);
+  map_size_ = map_size;
+
+  return true;
+}
+
+OutputBuffer& OutputBuffer::operator<<(const char* text) {
+  Write(text, strlen(text));
+  return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(const std::string& text) {
+  Write(text.data(), text.size());
+  return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(char character) {
+  Write(&character, 1);
+  return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(int value) {
+  // The buffer holds the longest possible int (sign + 10 digits)
+  char digits[24];
+  unsigned int magnitude = value < 0 ? 0u - static_cast<unsigned int>(value) :
+                                       static_cast<unsigned int>(value);
+  char* curr_digit = FormatNumber(digits + sizeof(digits), magnitude);
+  if (value < 0) {
+    *--curr_digit = '-';
+  }
+
+  Write(curr_digit, digits + sizeof(digits) - curr_digit);
+  return *this;
+}
+
+void OutputBuffer::Write(const char* data, size_t length) {
+  if (fd_ >= 0) {
+    memcpy(Extend(length), data, length);
+    return;
+  }
+
+  // Flush rather than grow the buffer, so that it is allocated only once
+  if (buffer_.size() + length > buffer_.capacity()) {
+    Flush();
+  }
+  buffer_.append(data, length);
+  if (buffer_.size() >= block_size_) {
+    Flush();
+  }
+}
+
+char* OutputBuffer::Reserve(size_t length) {
+  if (fd_ >= 0) {
+    return Extend(length);
+  }
+
+  // Flush any output completed by previous reservations first
+  if (buffer_.size() >= block_size_ ||
+      buffer_.size() + length > buffer_.capacity()) {
+    Flush();
+  }
+
+  size_t offset = buffer_.size();
+  buffer_.resize(offset + length);
+  return &buffer_[offset];
+}
+
+void OutputBuffer::Unreserve(size_t length) {
+  if (fd_ >= 0) {
+    if (!map_failed_) {
+      map_used_ -= length;
+    }
+    return;
+  }
+
+  buffer_.resize(buffer_.size() - length);
+}
+
+void OutputBuffer::Flush() {
+  // Mapped output is in the file already
+  if (fd_ >= 0) {
+    return;
+  }
+
+  ScopedTimer timer(Stats::kWrite);
+  if (!buffer_.empty()) {
+    if (stats != NULL) {
+      stats->bytes_written.fetch_add(buffer_.size(),
+                                     std::memory_order_relaxed);
+      stats->num_flushes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    output_->write(buffer_.data(), buffer_.size());
+    buffer_.clear();
+  }
+  if (streaming_) {
+    output_->flush();
+  }
+}
+
+PdfWriter::PdfWriter(OutputBuffer& output)
+    : output_(output), offset_(0), offsets_(3, 0) {
+}
+
+void PdfWriter::Start() {
+  std::ostringstream page_start;
+  page_start << "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 ";
+  page_start << kPdfPageWidth << " " << kPdfPageHeight;
+  page_start << "] /Resources 4 0 R /Contents [";
+  page_start_ = page_start.str();
+
+  // The comment with non-ASCII bytes marks the file as binary
+  Write("%PDF-1.4\n%\xE2\xE3\xCF\xD3\n");
+
+  // Objects 1 and 2 (catalog and page tree) are written by Finish()
+  BeginObject();
+  Write("<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica "
+        "/Encoding /WinAnsiEncoding >>\nendobj\n");
+  BeginObject();
+  Write("<< /Font << /F1 3 0 R >> >>\nendobj\n");
+}
+
+int PdfWriter::AddStream(const std::string& content) {
+  int object = BeginObject();
+  Write("<< /Length ");
+  WriteNumber(content.size());
+  Write(" >>\nstream\n");
+  Write(content);
+  Write("endstream\nendobj\n");
+
+  return object;
+}
+
+void PdfWriter::AddPage(const int* streams, int num_streams) {
+  pages_.push_back(BeginObject());
+  Write(page_start_);
+  for (int i = 0; i < num_streams; i++) {
+    if (i > 0) {
+      Write(" ");
+    }
+    WriteNumber(streams[i]);
+    Write(" 0 R");
+  }
+  Write("] >>\nendobj\n");
+}
+
+void PdfWriter::Expect(size_t num_pages) {
+  offsets_.reserve(offsets_.size() + 2 * num_pages);
+  pages_.reserve(pages_.size() + num_pages);
+}
+
+void PdfWriter::Finish() {
+  offsets_[2] = offset_;
+  Write("2 0 obj\n<< /Type /Pages /Count ");
+  WriteNumber(pages_.size());
+  Write(" /Kids [");
+  for (size_t i = 0; i < pages_.size(); i++) {
+    if (i > 0) {
+      Write(" ");
+    }
+    WriteNumber(pages_[i]);
+    Write(" 0 R");
+  }
+  Write("] >>\nendobj\n");
+  offsets_[1] = offset_;
+  Write("1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+
+  // Cross-reference table: one 20-byte entry per object
+  const size_t xref_offset = offset_;
+  Write("xref\n0 ");
+  WriteNumber(offsets_.size());
+  Write("\n0000000000 65535 f \n");
+  for (size_t i = 1; i < offsets_.size(); i++) {
+    WriteNumber(offsets_[i], 10);
+    Write(" 00000 n \n");
+  }
+  Write("trailer\n<< /Size ");
+  WriteNumber(offsets_.size());
+  Write(" /Root 1 0 R >>\nstartxref\n");
+  WriteNumber(xref_offset);
+  Write("\n%%EOF\n");
+}
+
+int PdfWriter::BeginObject() {
+  int object = static_cast<int>(offsets_.size());
+  offsets_.push_back(offset_);
+  WriteNumber(object);
+  Write(" 0 obj\n");
+
+  return object;
+}
+
+void PdfWriter::Write(const std::string& text) {
+  output_.Write(text.data(), text.size());
+  offset_ += text.size();
+}
+
+void PdfWriter::Write(const char* text) {
+  size_t length = strlen(text);
+  output_.Write(text, length);
+  offset_ += length;
+}
+
+void PdfWriter::WriteNumber(size_t value, int width) {
+  char digits[24];
+  char* end = digits + sizeof(digits);
+  char* begin = FormatNumber(end, value);
+  while (end - begin < width) {
+    *--begin = '0';
+  }
+  output_.Write(begin, end - begin);
+  offset_ += end - begin;
+}
+
+FingerprintSet::FingerprintSet() : size_(0) {
+}
+
+size_t FingerprintSet::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+bool FingerprintSet::Insert(uint64_t fingerprint) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Keep the table at most half full, doubling it as needed
+  if (2 * (size_ + 1) > slots_.size()) {
+    std::vector<uint64_t> old_slots;
+    old_slots.swap(slots_);
+    slots_.assign(std::max<size_t>(1024, 2 * old_slots.size()), 0);
+    size_ = 0;
+    for (size_t i = 0; i < old_slots.size(); i++) {
+      if (old_slots[i] != 0) {
+        Add(old_slots[i]);
+      }
+    }
+  }
+
+  size_t previous_size = size_;
+  Add(fingerprint);
+
+  return size_ != previous_size;
+}
+
+void FingerprintSet::Add(uint64_t fingerprint) {
+  // 0 marks the empty slots; the fingerprints are hashes already, so their low
+  // bits select the slot
+  if (fingerprint == 0) {
+    fingerprint = 1;
+  }
+  const size_t mask = slots_.size() - 1;
+  for (size_t i = fingerprint & mask; ; i = (i + 1) & mask) {
+    if (slots_[i] == fingerprint) {
+      return;
+    }
+    if (slots_[i] == 0) {
+      slots_[i] = fingerprint;
+      size_++;
+      return;
+    }
+  }
+}
+
+// A store is the header "ATFP", a 32-bit version (1) and a 64-bit count,
+// followed by that many 64-bit fingerprints, all in the byte order of the
+// machine which wrote it
+bool FingerprintSet::Load(const std::string& file) {
+  std::ifstream store(file.c_str(), std::ios::in | std::ios::binary);
+  if (!store.is_open()) {
+    return access(file.c_str(), F_OK) != 0;
+  }
+
+  char magic[4];
+  uint32_t version;
+  uint64_t count;
+  store.read(magic, sizeof(magic));
+  store.read(reinterpret_cast<char*>(&version), sizeof(version));
+  store.read(reinterpret_cast<char*>(&count), sizeof(count));
+  if (!store || memcmp(magic, "ATFP", 4) != 0 || version != 1) {
+    return false;
+  }
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t fingerprint;
+    if (!store.read(reinterpret_cast<char*>(&fingerprint),
+                    sizeof(fingerprint))) {
+      return false;
+    }
+    Insert(fingerprint);
+  }
+
+  return true;
+}
+
+bool FingerprintSet::Save(const std::string& file) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ostringstream temp_name;
+  temp_name << file << ".tmp" << getpid();
+  const std::string temp_file = temp_name.str();
+  std::ofstream store(temp_file.c_str(), std::ios::out | std::ios::binary);
+  const uint32_t version = 1;
+  const uint64_t count = size_;
+  store.write("ATFP", 4);
+  store.write(reinterpret_cast<const char*>(&version), sizeof(version));
+  store.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  for (size_t i = 0; i < slots_.size(); i++) {
+    if (slots_[i] != 0) {
+      store.write(reinterpret_cast<const char*>(&slots_[i]),
+                  sizeof(slots_[i]));
+    }
+  }
+  store.close();
+  if (!store || rename(temp_file.c_str(), file.c_str()) != 0) {
+    unlink(temp_file.c_str());
+
+    return false;
+  }
+
+  return true;
+}
+
+// Key of the tally of a problem: the operation and both operands (dividends
+// take 15 bits)
+static uint32_t TallyKey(Operation operation, int first, int second) {
+  return (static_cast<uint32_t>(operation) << 26) |
+         (static_cast<uint32_t>(first & 0x7fff) << 10) |
+         static_cast<uint32_t>(second & 0x3ff);
+}
+
+void ProblemResults::Add(Operation operation, int first, int second,
+                         bool correct) {
+  Tally& tally = tallies_[TallyKey(operation, first, second)];
+  tally.answers++;
+  if (!correct) {
+    tally.misses++;
+  }
+}
+
+bool ProblemResults::Load(const std::string& file, Operation operation,
+                          std::string* error) {
+  std::ifstream input(file.c_str(), std::ios::in | std::ios::binary);
+  if (!input.is_open()) {
+    *error = "unable to open results file " + file;
+
+    return false;
+  }
+
+  // Binary: the header and one record per answer
+  char magic[4] = {0, 0, 0, 0};
+  input.read(magic, sizeof(magic));
+  if (memcmp(magic, "ATRS", 4) == 0) {
+    ResultsHeader header;
+    memcpy(header.magic, magic, sizeof(magic));
+    input.read(reinterpret_cast<char*>(&header) + sizeof(magic),
+               sizeof(header) - sizeof(magic));
+    if (!input || header.version != 1) {
+      *error = "results file " + file + " is not a version 1 results file";
+
+      return false;
+    }
+    for (uint32_t r = 0; r < header.num_records; r++) {
+      ResultRecord record;
+      if (!input.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        *error = "results file " + file + " is truncated";
+
+        return false;
+      }
+      const char name[2] = {record.operation, '\0'};
+      Operation record_operation;
+      if (!ParseOperation(name, &record_operation) || record.correct > 1 ||
+          record.first < 0 || record.second < 0 ||
+          record.second > kMaxOperand) {
+        *error = "results file " + file + " has invalid records";
+
+        return false;
+      }
+      Add(record_operation, record.first, record.second, record.correct == 1);
+    }
+
+    return true;
+  }
+
+  // CSV: the columns are found by the names in the header row. Districts
+  // load a results file per packet, so the rows are scanned in place rather
+  // than through string streams.
+  input.clear();
+  input.seekg(0);
+  std::string line;
+  std::vector<size_t> field_starts;  // Offset of each field, plus the end
+  int columns[4] = {-1, -1, -1, -1};  // first, second, correct, operation
+  const char* const kColumnNames[4] = {"first", "second", "correct",
+                                       "operation"};
+  for (int line_number = 1; std::getline(input, line); line_number++) {
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    if (line.empty()) {
+      continue;
+    }
+    field_starts.assign(1, 0);
+    for (size_t i = 0; i < line.size(); i++) {
+      if (line[i] == ',') {
+        field_starts.push_back(i + 1);
+      }
+    }
+    field_starts.push_back(line.size() + 1);
+    const int num_fields = static_cast<int>(field_starts.size()) - 1;
+
+    if (columns[0] < 0) {
+      for (int f = 0; f < num_fields; f++) {
+        for (int c = 0; c < 4; c++) {
+          if (line.compare(field_starts[f], field_starts[f + 1] -
+                           field_starts[f] - 1, kColumnNames[c]) == 0) {
+            columns[c] = f;
+          }
+        }
+      }
+      if (columns[0] < 0 || columns[1] < 0 || columns[2] < 0) {
+        *error = "results file " + file + " has no header row with first, " +
+                 "second and correct columns";
+
+        return false;
+      }
+      continue;
+    }
+
+    // Values are non-negative integers (at most 5 digits)
+    int values[3];
+    Operation row_operation = operation;
+    bool valid = true;
+    for (int c = 0; c < 3 && valid; c++) {
+      valid = columns[c] < num_fields;
+      if (valid) {
+        const char* begin = line.data() + field_starts[columns[c]];
+        const char* end = line.data() + field_starts[columns[c] + 1] - 1;
+        valid = begin < end && end - begin <= 5;
+        values[c] = 0;
+        for (const char* digit = begin; valid && digit < end; digit++) {
+          valid = *digit >= '0' && *digit <= '9';
+          values[c] = values[c] * 10 + (*digit - '0');
+        }
+      }
+    }
+    if (valid && columns[3] >= 0) {
+      valid = columns[3] < num_fields &&
+              field_starts[columns[3] + 1] - field_starts[columns[3]] == 2;
+      if (valid) {
+        const char name[2] = {line[field_starts[columns[3]]], '\0'};
+        valid = ParseOperation(name, &row_operation);
+      }
+    }
+    if (!valid || values[0] > INT16_MAX || values[1] > kMaxOperand ||
+        values[2] > 1) {
+      std::ostringstream message;
+      message << "results file " << file << " line " << line_number;
+      message << " is not a valid result";
+      *error = message.str();
+
+      return false;
+    }
+    Add(row_operation, values[0], values[1], values[2] == 1);
+  }
+  if (columns[0] < 0) {
+    *error = "results file " + file + " is empty";
+
+    return false;
+  }
+
+  return true;
+}
+
+double ProblemResults::Weight(Operation operation, int first,
+                              int second) const {
+  std::map<uint32_t, Tally>::const_iterator tally =
+      tallies_.find(TallyKey(operation, first, second));
+  if (tally == tallies_.end()) {
+    return 1;
+  }
+
+  return 1 + (kMissWeight - 1) * static_cast<double>(tally->second.misses) /
+             tally->second.answers;
+}
+
+}  // namespace packet_generator
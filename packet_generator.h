@@ -0,0 +1,397 @@
+// Library interface for creating arithmetic test packets: the problem pools,
+// test pages, answer keys and packet files (LaTeX source or PDF) of the
+// arithmetic_test program, for use by other programs without running it.
+//
+//   packet_generator::PacketGenerator generator(options);
+//   std::ostringstream packet_out;
+//   packet_generator::OutputBuffer output(packet_out, options.buffer_size);
+//   if (!generator.Generate(packet, output, NULL)) {
+//     ... generator.error() ...
+//   }
+//   output.Flush();
+//
+// The problem pools and page templates are set up on first use and shared by
+// all generators, so packets can be generated from several threads at once.
+// Everything is in namespace packet_generator, and nothing is printed: errors
+// and warnings are returned to the caller.
+
+#ifndef PACKET_GENERATOR_H_
+#define PACKET_GENERATOR_H_
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace packet_generator {
+
+// Output sink which collects the generated LaTeX source in memory and writes it
+// to the underlying stream in large blocks only (instead of flushing every row)
+//
+// In mapped mode, the output goes straight into a shared memory mapping of the
+// output file instead, which is grown (and preallocated on disk) as needed, so
+// that reserved space is rendered in place in the file without any copying.
+class OutputBuffer {
+ public:
+  // In streaming mode, every flush of the buffer also flushes the underlying
+  // stream, so that a reader at the other end sees each block right away
+  OutputBuffer(std::ostream& output, size_t block_size, bool streaming = false);
+  // Mapped mode: fd is an empty file open for reading and writing
+  explicit OutputBuffer(int fd);
+  ~OutputBuffer();
+
+  bool streaming() const { return streaming_; }
+
+  // Whether writing to the underlying stream (or mapping the file) has failed
+  bool failed() const { return fd_ >= 0 ? map_failed_ : output_->fail(); }
+
+  // Hint that length more bytes are going to follow, so that the mapped file
+  // can be preallocated in one go
+  void Expect(size_t length);
+
+  // Mapped mode: unmap the file and truncate it to the output written; returns
+  // false if mapping or growing the file failed at any point
+  bool Close();
+
+  OutputBuffer& operator<<(const char* text);
+  OutputBuffer& operator<<(const std::string& text);
+  OutputBuffer& operator<<(char character);
+  OutputBuffer& operator<<(int value);
+
+  // Append length bytes of raw data
+  void Write(const char* data, size_t length);
+
+  // Append length bytes to be filled in by the caller and return a pointer to
+  // them; the pointer is valid until the next call on this buffer
+  char* Reserve(size_t length);
+
+  // Give back the last length bytes of a reservation, if it was the last call
+  // on this buffer (e.g. when they could not be filled in)
+  void Unreserve(size_t length);
+
+  // Write everything collected so far to the underlying stream
+  void Flush();
+
+ private:
+  // Mapped mode: make room for length more bytes and return a pointer to them
+  char* Extend(size_t length);
+  bool Map(size_t map_size);
+
+  std::ostream* output_;
+  std::string buffer_;
+  size_t block_size_;
+  bool streaming_;
+
+  // Mapped mode only (fd_ is -1 otherwise). After a failure, output is
+  // discarded into buffer_ until Close()
+  int fd_;
+  char* map_;
+  size_t map_size_;
+  size_t map_used_;
+  bool map_failed_;
+};
+
+// Largest operand value of the operand ranges (operands are stored in 16 bits)
+const int kMaxOperand = 999;
+
+// Range of values an operand is drawn from
+struct OperandRange {
+  int low;
+  int high;
+};
+
+// Arithmetic operations which tests can be created for
+enum Operation {
+  kAddition,
+  kMultiplication,
+  kSubtraction,
+  kDivision
+};
+
+// Largest weight of an operation of a mixed packet
+const int kMaxMixWeight = 1000;
+
+// Operation of a mixed packet, and how likely each test is to be of it: a test
+// is of an operation with probability weight / (sum of the weights of the mix)
+struct OperationWeight {
+  Operation operation;
+  int weight;
+};
+
+// Past results of a student: how often each problem was answered, and how
+// often it was missed. The tests of a packet created with results draw their
+// problems by weight (with replacement) instead of uniformly, so that missed
+// problems come up more often.
+class ProblemResults {
+ public:
+  // Weight of a problem missed on every answer, relative to one which was
+  // never missed (or never answered)
+  static const int kMissWeight = 5;
+
+  // Add one answer to a problem
+  void Add(Operation operation, int first, int second, bool correct);
+
+  // Add the answers stored in file: a binary results file (see ResultsHeader)
+  // or CSV with a header row naming at least the first, second and correct
+  // (0 or 1) columns, such as an answer key with a correct column added. CSV
+  // rows without an operation column are answers to problems of operation.
+  // Returns false with an error message if the file cannot be read or is in
+  // neither format.
+  bool Load(const std::string& file, Operation operation, std::string* error);
+
+  // Sampling weight of a problem: 1, up to kMissWeight for a problem which
+  // was missed on every answer, in proportion to its misses
+  double Weight(Operation operation, int first, int second) const;
+
+  // Number of problems with answers
+  size_t size() const { return tallies_.size(); }
+
+ private:
+  struct Tally {
+    uint32_t answers;
+    uint32_t misses;
+  };
+
+  std::map<uint32_t, Tally> tallies_;  // By operation and operands
+};
+
+// The binary results file is a header followed by a record per answer, in the
+// byte order of the machine which wrote it
+struct ResultsHeader {
+  char magic[4];  // "ATRS"
+  uint16_t version;
+  char reserved[2];
+  uint32_t num_records;
+};
+
+struct ResultRecord {
+  char operation;  // Test type: 'a', 'm', 's' or 'd'
+  uint8_t correct;  // 1 if answered correctly, 0 if missed
+  int16_t first;
+  int16_t second;
+  int16_t reserved;
+};
+
+static_assert(sizeof(ResultsHeader) == 12 && sizeof(ResultRecord) == 8,
+              "the results layout must not contain padding");
+
+// Everything needed to create one packet
+struct PacketRequest {
+  Operation operation;  // The first one of mix for a mixed packet
+
+  // Operations of a mixed packet (at least two), in test_type order, or empty
+  // for a packet of operation only. Each test of a mixed packet draws its
+  // operation, and the packet has the solutions pages of every operation.
+  std::vector<OperationWeight> mix;
+
+  OperandRange first_range;
+  OperandRange second_range;
+  int problems_per_test;  // 0 for the whole pool
+  bool no_repeat;
+  bool unique;  // Redraw tests repeating an earlier test (see FingerprintSet)
+  int num_tests;
+  uint64_t seed;
+
+  // Create only num_selected tests, from test first_test (0-based) on, as a
+  // document of just their pages; 0 for the whole packet. The selected tests
+  // are the same as in the whole packet, and cannot be unique.
+  int first_test;
+  int num_selected;
+
+  // Past results to draw the problems by, or NULL to draw them uniformly;
+  // cannot be combined with no_repeat
+  const ProblemResults* results;
+};
+
+// Format of the answer key written next to each packet
+enum AnswerKeyFormat {
+  kNoAnswerKey,
+  kBinaryAnswerKey,  // '.key': see AnswerKeyHeader and AnswerKeyRecord
+  kCsvAnswerKey      // '.csv': test,page,problem,first,second,answer rows
+};
+
+// The binary answer key is a header followed by problems_per_test records per
+// test, in test order and in page order within a test. All fields are stored in
+// the byte order of the machine which created the key, and the records have a
+// fixed size, so the key of test n (0-based) starts at byte
+// sizeof(AnswerKeyHeader) + n * problems_per_test * sizeof(AnswerKeyRecord).
+//
+// The key of a mixed packet is version 2 instead: its header has operation 0
+// and problems_per_test 0, and is followed by an AnswerKeyTest per test and
+// then the records of every test, so the key of test n starts after the
+// records of the tests before it.
+//
+// The key of selected tests (see PacketRequest::num_selected) is version 3, or
+// 4 if the packet is mixed: the header is followed by an AnswerKeySelection
+// with the number of the first selected test, and num_tests is the number of
+// selected tests; the rest is as in version 1 or 2.
+struct AnswerKeyHeader {
+  char magic[4];  // "ATKY"
+  uint16_t version;
+  char operation;  // Test type: 'a', 'm', 's' or 'd'
+  char reserved;
+  uint32_t num_tests;
+  uint32_t problems_per_test;
+};
+
+struct AnswerKeySelection {
+  uint32_t first_test;  // Numbered from 1, as on the score tracker
+  uint32_t reserved;
+};
+
+struct AnswerKeyTest {
+  char operation;
+  char reserved[3];
+  uint32_t problems_per_test;
+};
+
+struct AnswerKeyRecord {
+  int16_t first;
+  int16_t second;
+  int32_t answer;
+};
+
+static_assert(sizeof(AnswerKeyHeader) == 16 && sizeof(AnswerKeyTest) == 8 &&
+              sizeof(AnswerKeyRecord) == 8,
+              "the answer key layout must not contain padding");
+
+// Format of the packet files
+enum OutputFormat {
+  kLatexOutput,  // '.tex', to be processed separately
+  kPdfOutput     // '.pdf', the same layout written directly
+};
+
+// Set of the fingerprints (64-bit hashes of the problems in page order) of the
+// tests created with PacketRequest::unique. A test whose fingerprint is in the
+// set already is redrawn from its random number stream. The set uses open
+// addressing with linear probing in a table which is kept at most half full
+// and doubled as it fills, so it takes 16 to 32 bytes per test (up to 32 MB
+// for a million tests, and the old table on top while it is doubled). A set
+// may be shared by packets which are created at the same time; its operations
+// are serialized.
+class FingerprintSet {
+ public:
+  FingerprintSet();
+
+  size_t size() const;
+
+  // Add a fingerprint; returns false if it was in the set already
+  bool Insert(uint64_t fingerprint);
+
+  // Add the fingerprints stored in file (see Save); a missing file is an empty
+  // store. Returns false if the file cannot be read or is not a store.
+  bool Load(const std::string& file);
+
+  // Store the fingerprints in file, replacing it atomically; returns false if
+  // the file cannot be written
+  bool Save(const std::string& file) const;
+
+ private:
+  void Add(uint64_t fingerprint);  // Without locking or growing
+
+  mutable std::mutex mutex_;
+  std::vector<uint64_t> slots_;  // 0 for an empty slot
+  size_t size_;
+};
+
+// How packets are written (as opposed to what they contain)
+struct OutputOptions {
+  OutputFormat format;
+  size_t buffer_size;  // Bytes collected in memory before each write
+  int num_threads;
+  bool pipe;           // Stream the output page by page
+  bool mmap;           // Render into a memory mapping of the output file
+  int gzip_level;      // Compress the packet files at this zlib level (1 to
+                       // 9), or 0 not to
+  AnswerKeyFormat answer_key;
+  std::string cache_dir;  // Preface cache directory; empty for no cache
+
+  // Fingerprints of earlier unique tests, shared by all packets created with
+  // these options; NULL for a set per packet
+  FingerprintSet* fingerprints;
+};
+
+class RenderPool;
+
+// Creates packets into caller-supplied output buffers. A generator holds its
+// options, the last error, and the render threads (options.num_threads - 1 of
+// them) and pool copies they work with, which are set up on its first packet
+// and reused by later ones; creating many packets with one generator is
+// cheaper than with a generator each. Threads which generate packets at the
+// same time each use their own generator.
+class PacketGenerator {
+ public:
+  // Only options.format, num_threads, answer_key, cache_dir and fingerprints
+  // apply (how the output is buffered, or compressed, is up to the
+  // OutputBuffer passed to Generate)
+  explicit PacketGenerator(const OutputOptions& options);
+  ~PacketGenerator();  // Stops the render threads
+
+  // Write the packet to output and, if key_output is given, its answer key in
+  // options.answer_key format (binary if no format is set). Returns false
+  // without writing anything if the packet cannot be created; error() then
+  // tells why. Generate also gives up on the packet, returning false, once
+  // output or key_output has failed (see OutputBuffer::failed) after a chunk
+  // of tests, such as when the reader of a socket is gone; what was written
+  // until then is left as it is. Output still buffered on return is only
+  // written (and checked) by the caller.
+  bool Generate(const PacketRequest& packet, OutputBuffer& output,
+                OutputBuffer* key_output);
+
+  // Reason why the last call of Generate failed
+  const std::string& error() const { return error_; }
+
+  // Problem of the last call of Generate which did not keep it from creating
+  // the packet (such as a preface cache which cannot be used), or empty
+  const std::string& warning() const { return warning_; }
+
+  // Number of tests of the last packet which still repeat an earlier test
+  // after being redrawn a number of times (only if the operand ranges have
+  // too few different tests for a unique packet)
+  int repeated_tests() const { return repeated_tests_; }
+
+ private:
+  // Create a packet which has been checked by Generate; returns false if it
+  // was given up because the output could not be written
+  bool WritePacket(const PacketRequest& packet, OutputBuffer& output,
+                   OutputBuffer* key_output);
+
+  OutputOptions options_;
+  std::string error_;
+  std::string warning_;
+  int repeated_tests_;
+  std::unique_ptr<RenderPool> render_pool_;  // Created on first use
+
+  PacketGenerator(const PacketGenerator&);  // Not copyable
+  PacketGenerator& operator=(const PacketGenerator&);
+};
+
+// Parsing and validation of packet requests, with the rules of the command
+// line options
+bool ParseOperation(const char* text, Operation* operation);
+
+bool ParseTestType(const char* text, Operation* operation,
+                   std::vector<OperationWeight>* mix);
+
+bool ParseRanges(const char* text, OperandRange* first_range,
+                 OperandRange* second_range);
+
+bool ParseTestSelection(const char* text, int* first_test, int* num_selected);
+
+bool CheckRanges(const PacketRequest& packet, std::string* error);
+
+size_t PoolSize(const PacketRequest& packet);
+
+uint64_t RandomSeed();
+
+uint64_t PacketIdHash(const std::string& packet_id);
+
+uint64_t PacketSeed(uint64_t batch_seed, const std::string& packet_id);
+
+}  // namespace packet_generator
+
+#endif  // PACKET_GENERATOR_H_
@@ -0,0 +1,469 @@
+// Benchmark of the packet generator:
+//
+//   packet_generator_benchmark [max_tests] [--baseline file]
+//
+// Measures problem setup, shuffling, page rendering, complete packet creation
+// and file writes separately for each operation and for packets of 1, 10,
+// 100, ... tests up to max_tests (default: 100000), and checks that packets
+// reach a steady state without heap allocations in every output mode. With
+// --baseline, the complete packet rates are also compared with those saved in
+// file by an earlier run (see CompareBaseline). Exits with status 1 if a check
+// fails.
+
+#include "packet_generator.h"
+#include "packet_generator_internal.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+
+using packet_generator::OperandRange;
+using packet_generator::Operation;
+using packet_generator::OutputBuffer;
+using packet_generator::OutputOptions;
+using packet_generator::PacketGenerator;
+using packet_generator::PacketRequest;
+using packet_generator::ProblemSet;
+using packet_generator::ProblemSetup;
+using packet_generator::RenderTestPage;
+using packet_generator::ShuffleProblems;
+using packet_generator::Xoshiro256;
+using packet_generator::kAddition;
+using packet_generator::kBinaryAnswerKey;
+using packet_generator::kCsvAnswerKey;
+using packet_generator::kDivision;
+using packet_generator::kLatexOutput;
+using packet_generator::kMultiplication;
+using packet_generator::kNoAnswerKey;
+using packet_generator::kPdfOutput;
+using packet_generator::kSubtraction;
+
+// Number of heap allocations made so far; every allocation of the program goes
+// through the replacement operator new (see the end of this file), so the
+// allocations made per page can be reported
+static std::atomic<size_t> num_allocations(0);
+
+// Stream buffer which only counts the bytes written to it
+class CountingStreamBuffer : public std::streambuf {
+ public:
+  CountingStreamBuffer() : num_bytes_(0) {}
+
+  size_t num_bytes() const { return num_bytes_; }
+
+ protected:
+  int overflow(int character) {
+    num_bytes_++;
+    return traits_type::not_eof(character);
+  }
+
+  std::streamsize xsputn(const char* data, std::streamsize length) {
+    (void)data;
+    num_bytes_ += length;
+    return length;
+  }
+
+ private:
+  size_t num_bytes_;
+};
+
+// Complete packet rate of a benchmark packet size, in pages/s
+struct BenchmarkRate {
+  char operation;
+  long long num_tests;
+  double pages_per_second;
+};
+
+// Prototypes
+void BenchmarkOperation(char name, Operation operation, int max_tests,
+                        int output_fd,
+                        std::vector<BenchmarkRate>* packet_rates);
+
+bool CheckSteadyAllocations(char name, Operation operation);
+
+bool CompareBaseline(const std::string& baseline_file,
+                     const std::vector<BenchmarkRate>& packet_rates);
+
+static double SecondsSince(std::chrono::steady_clock::time_point start);
+
+int main(int argc, char* argv[]) {
+  int max_tests = 100000;
+  std::string baseline_file;
+  for (int a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "--baseline") == 0 && a + 1 < argc) {
+      baseline_file = argv[++a];
+      continue;
+    }
+
+    std::istringstream input(argv[a]);
+    if (!(input >> max_tests && input.eof() && max_tests > 0)) {
+      std::cerr << "usage: " << argv[0] << " [max_tests] [--baseline file]";
+      std::cerr << std::endl;
+
+      return 1;
+    }
+  }
+
+  // File writes go to a temporary file which is removed again right away
+  char temp_file[] = "/tmp/packet_generator_benchmark.XXXXXX";
+  int output_fd = mkstemp(temp_file);
+  if (output_fd < 0) {
+    std::cerr << "Error: unable to create a temporary file." << std::endl;
+
+    return 1;
+  }
+  unlink(temp_file);
+
+  std::cout << "Rates in pages/s (shuffle, render, packet) and MB/s ";
+  std::cout << "(render, packet, write);\n";
+  std::cout << "packet = complete packet written to memory.\n\n";
+  std::cout << std::setw(4) << "op" << std::setw(8) << "tests";
+  std::cout << std::setw(12) << "shuffle" << std::setw(12) << "render";
+  std::cout << std::setw(10) << "render" << std::setw(12) << "packet";
+  std::cout << std::setw(10) << "packet" << std::setw(10) << "write";
+  std::cout << std::setw(13) << "allocs/page" << "\n";
+
+  std::vector<BenchmarkRate> packet_rates;
+  BenchmarkOperation('a', kAddition, max_tests, output_fd, &packet_rates);
+  BenchmarkOperation('m', kMultiplication, max_tests, output_fd,
+                     &packet_rates);
+  BenchmarkOperation('s', kSubtraction, max_tests, output_fd, &packet_rates);
+  BenchmarkOperation('d', kDivision, max_tests, output_fd, &packet_rates);
+  std::cout.flush();
+
+  close(output_fd);
+
+  // Once a packet is under way, further pages must not allocate: only the
+  // setup of a packet (workspaces, chunk buffers, PDF object tables) may
+  std::cout << "\nHeap allocations of the second 1000 tests of a packet ";
+  std::cout << "(must be 0):\n";
+  std::cout << std::setw(4) << "op" << std::setw(8) << "tex";
+  std::cout << std::setw(8) << "-k" << std::setw(11) << "no-repeat";
+  std::cout << std::setw(8) << "key" << std::setw(8) << "csv";
+  std::cout << std::setw(8) << "pdf" << std::setw(12) << "pdf -k key";
+  std::cout << std::setw(8) << "-j 4" << std::setw(13) << "-j 4 -k key";
+  std::cout << "\n";
+  bool steady = CheckSteadyAllocations('a', kAddition);
+  steady &= CheckSteadyAllocations('m', kMultiplication);
+  steady &= CheckSteadyAllocations('s', kSubtraction);
+  steady &= CheckSteadyAllocations('d', kDivision);
+  std::cout.flush();
+  if (!steady) {
+    std::cerr << "Error: pages are allocating memory in the steady state.";
+    std::cerr << std::endl;
+
+    return 1;
+  }
+
+  if (!baseline_file.empty() && !CompareBaseline(baseline_file, packet_rates)) {
+    return 1;
+  }
+
+  return 0;
+}
+
+// Benchmark one operation (name is its test_type character); output_fd is the
+// file used to measure writes
+void BenchmarkOperation(char name, Operation operation, int max_tests,
+                        int output_fd,
+                        std::vector<BenchmarkRate>* packet_rates) {
+  const double kMegabyte = 1 << 20;
+
+  // Problem pool and page template setup (with the default ranges)
+  const OperandRange kRange = {0, 9};
+  const int kSetupRepeats = 100;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (int r = 0; r < kSetupRepeats; r++) {
+    delete ProblemSetup::Create(operation, kRange, kRange, 0);
+  }
+  double setup_time = SecondsSince(start) / kSetupRepeats;
+  std::cout << std::setw(4) << name << "   setup: " << std::fixed;
+  std::cout << std::setprecision(1) << setup_time * 1e6 << " us\n";
+
+  const ProblemSetup& setup = ProblemSetup::Get(operation, kRange, kRange, 0);
+  const ProblemSet& problems = setup.problems;
+  const size_t page_size = setup.test_size();
+  std::vector<char> page(page_size);
+  ProblemSet shuffled;
+  PacketRequest packet;
+  packet.operation = operation;
+  packet.first_range = kRange;
+  packet.second_range = kRange;
+  packet.problems_per_test = 0;
+  packet.no_repeat = false;
+  packet.unique = false;
+  packet.first_test = 0;
+  packet.num_selected = 0;
+  packet.results = NULL;
+  OutputOptions options;
+  options.format = kLatexOutput;
+  options.buffer_size = 1 << 20;
+  options.num_threads = 1;
+  options.pipe = false;
+  options.mmap = false;
+  options.gzip_level = 0;
+  options.answer_key = kNoAnswerKey;
+  options.fingerprints = NULL;
+
+  for (long long num_tests = 1; num_tests <= max_tests; num_tests *= 10) {
+    int num_pages = static_cast<int>(num_tests);
+
+    // Shuffling, including setting up the random number streams
+    start = std::chrono::steady_clock::now();
+    for (int n = 0; n < num_pages; n++) {
+      Xoshiro256 page_rng(num_tests, n);
+      shuffled = problems;
+      ShuffleProblems(&shuffled, page_rng);
+    }
+    double shuffle_time = SecondsSince(start);
+
+    // Rendering the (last) shuffled problems into a page
+    start = std::chrono::steady_clock::now();
+    for (int n = 0; n < num_pages; n++) {
+      RenderTestPage(&page[0], setup.last_page, &shuffled.first[0],
+                     &shuffled.second[0]);
+    }
+    double render_time = SecondsSince(start);
+
+    // Complete packet, written to memory only
+    CountingStreamBuffer counter;
+    std::ostream null_stream(&counter);
+    size_t allocations_before = num_allocations;
+    start = std::chrono::steady_clock::now();
+    {
+      OutputBuffer output(null_stream, 1 << 20);
+      packet.num_tests = num_pages;
+      packet.seed = num_tests;
+      PacketGenerator(options).Generate(packet, output, NULL);
+    }
+    double packet_time = SecondsSince(start);
+    size_t packet_allocations = num_allocations - allocations_before;
+    BenchmarkRate rate = {name, num_tests, num_pages / packet_time};
+    packet_rates->push_back(rate);
+
+    // Writing the same amount of test pages to a file
+    lseek(output_fd, 0, SEEK_SET);
+    start = std::chrono::steady_clock::now();
+    for (int n = 0; n < num_pages; n++) {
+      if (write(output_fd, &page[0], page_size) < 0) {
+        break;
+      }
+    }
+    double write_time = SecondsSince(start);
+    if (ftruncate(output_fd, 0) < 0) {
+      std::cerr << "Warning: unable to truncate the temporary file.";
+      std::cerr << std::endl;
+    }
+
+    std::cout << std::setw(4) << name << std::setw(8) << num_tests;
+    std::cout << std::setprecision(0);
+    std::cout << std::setw(12) << num_pages / shuffle_time;
+    std::cout << std::setw(12) << num_pages / render_time;
+    std::cout << std::setprecision(1);
+    std::cout << std::setw(10) << num_pages * page_size / kMegabyte /
+                                  render_time;
+    std::cout << std::setprecision(0);
+    std::cout << std::setw(12) << num_pages / packet_time;
+    std::cout << std::setprecision(1);
+    std::cout << std::setw(10) << counter.num_bytes() / kMegabyte /
+                                  packet_time;
+    std::cout << std::setw(10) << num_pages * page_size / kMegabyte /
+                                  write_time;
+    std::cout << std::setprecision(2);
+    std::cout << std::setw(13) << static_cast<double>(packet_allocations) /
+                                  num_pages << "\n";
+  }
+}
+
+// Check that packets of the operation reach a steady state without heap
+// allocations in each output mode: a packet of 2000 tests must not allocate
+// more than one of 1000 tests made by the same generator, single-threaded and
+// with -j 4. Returns false if one does.
+bool CheckSteadyAllocations(char name, Operation operation) {
+  const int kNumModes = 9;
+  const int kWidths[kNumModes] = {8, 8, 11, 8, 8, 8, 12, 8, 13};
+  const int kTests = 1000;
+  const OperandRange kRange = {0, 9};
+
+  bool steady = true;
+  std::cout << std::setw(4) << name;
+  for (int mode = 0; mode < kNumModes; mode++) {
+    PacketRequest packet;
+    packet.operation = operation;
+    packet.first_range = kRange;
+    packet.second_range = kRange;
+    packet.problems_per_test =
+        (mode == 1 || mode == 2 || mode == 6 || mode == 8) ? 50 : 0;
+    packet.no_repeat = mode == 2;
+    packet.unique = false;
+    packet.first_test = 0;
+    packet.num_selected = 0;
+    packet.results = NULL;
+    packet.seed = mode;
+    OutputOptions options;
+    options.format = (mode == 5 || mode == 6) ? kPdfOutput : kLatexOutput;
+    options.buffer_size = 1 << 20;
+    options.num_threads = mode >= 7 ? 4 : 1;
+    options.pipe = false;
+    options.mmap = false;
+    options.gzip_level = 0;
+    options.answer_key = mode == 4 ? kCsvAnswerKey : kBinaryAnswerKey;
+    options.fingerprints = NULL;
+    const bool with_key = mode == 3 || mode == 4 || mode == 6 || mode == 8;
+
+    // The first packet sets up the problem pool and page templates, and the
+    // render threads of the generator
+    PacketGenerator generator(options);
+    size_t allocations[3];
+    for (int run = 0; run < 3; run++) {
+      CountingStreamBuffer counter;
+      CountingStreamBuffer key_counter;
+      std::ostream null_stream(&counter);
+      std::ostream key_stream(&key_counter);
+      packet.num_tests = run * kTests + 1;
+      size_t allocations_before = num_allocations;
+      {
+        OutputBuffer output(null_stream, options.buffer_size);
+        OutputBuffer key_output(key_stream, options.buffer_size);
+        generator.Generate(packet, output, with_key ? &key_output : NULL);
+      }
+      allocations[run] = num_allocations - allocations_before;
+    }
+
+    size_t extra = allocations[2] > allocations[1] ?
+                   allocations[2] - allocations[1] : 0;
+    std::cout << std::setw(kWidths[mode]) << extra;
+    if (extra > 0) {
+      steady = false;
+    }
+  }
+  std::cout << "\n";
+
+  return steady;
+}
+
+// Compare the complete packet rates with those of an earlier run in
+// baseline_file (lines of test type, number of tests and pages/s), which is
+// created from this run if it does not exist yet. Single rates are noisy, so
+// the median ratio to the baseline over the packets of at least kMinTests
+// tests is checked: returns false (after printing an error message) if it is
+// below kMinRatio, or if the file cannot be read or written.
+bool CompareBaseline(const std::string& baseline_file,
+                     const std::vector<BenchmarkRate>& packet_rates) {
+  // Smaller packets are dominated by timer resolution and setup
+  const long long kMinTests = 100;
+  const double kMinRatio = 0.8;
+
+  std::ifstream baseline_in(baseline_file.c_str());
+  if (!baseline_in.is_open()) {
+    std::ofstream baseline_out(baseline_file.c_str());
+    for (size_t r = 0; r < packet_rates.size(); r++) {
+      baseline_out << packet_rates[r].operation << " ";
+      baseline_out << packet_rates[r].num_tests << " " << std::fixed;
+      baseline_out << std::setprecision(0);
+      baseline_out << packet_rates[r].pages_per_second << "\n";
+    }
+    baseline_out.close();
+    if (!baseline_out) {
+      std::cerr << "Error: unable to write baseline file " << baseline_file;
+      std::cerr << "." << std::endl;
+
+      return false;
+    }
+    std::cout << "\nSaved the packet rates as the baseline." << std::endl;
+
+    return true;
+  }
+
+  std::map<std::pair<char, long long>, double> baseline;
+  char operation;
+  long long num_tests;
+  double pages_per_second;
+  while (baseline_in >> operation >> num_tests >> pages_per_second) {
+    baseline[std::make_pair(operation, num_tests)] = pages_per_second;
+  }
+  if (!baseline_in.eof()) {
+    std::cerr << "Error: unable to read baseline file " << baseline_file;
+    std::cerr << "." << std::endl;
+
+    return false;
+  }
+
+  std::cout << "\nPacket rates against the baseline (the median ratio must ";
+  std::cout << "be at least " << std::fixed << std::setprecision(2);
+  std::cout << kMinRatio << "):\n";
+  std::cout << std::setw(4) << "op" << std::setw(8) << "tests";
+  std::cout << std::setw(12) << "baseline" << std::setw(12) << "packet";
+  std::cout << std::setw(8) << "ratio" << "\n";
+  std::vector<double> ratios;
+  for (size_t r = 0; r < packet_rates.size(); r++) {
+    std::map<std::pair<char, long long>, double>::const_iterator found =
+        baseline.find(std::make_pair(packet_rates[r].operation,
+                                     packet_rates[r].num_tests));
+    if (packet_rates[r].num_tests < kMinTests || found == baseline.end() ||
+        found->second <= 0) {
+      continue;
+    }
+
+    double ratio = packet_rates[r].pages_per_second / found->second;
+    std::cout << std::setw(4) << packet_rates[r].operation;
+    std::cout << std::setw(8) << packet_rates[r].num_tests;
+    std::cout << std::setprecision(0) << std::setw(12) << found->second;
+    std::cout << std::setw(12) << packet_rates[r].pages_per_second;
+    std::cout << std::setprecision(2) << std::setw(8) << ratio << "\n";
+    ratios.push_back(ratio);
+  }
+  if (ratios.empty()) {
+    std::cout << "No packet rates to compare." << std::endl;
+
+    return true;
+  }
+
+  std::sort(ratios.begin(), ratios.end());
+  double median = ratios.size() % 2 == 1 ? ratios[ratios.size() / 2] :
+      (ratios[ratios.size() / 2 - 1] + ratios[ratios.size() / 2]) / 2;
+  std::cout << "Median ratio: " << median << std::endl;
+  if (median < kMinRatio) {
+    std::cerr << "Error: packets are slower than the baseline." << std::endl;
+
+    return false;
+  }
+
+  return true;
+}
+
+// Seconds elapsed since start
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start).count();
+}
+
+// The replacement allocation functions are kept out of line so that the
+// compiler does not match the inlined malloc and free calls against new and
+// delete expressions and warn about a mismatch
+__attribute__((noinline)) void* operator new(size_t size) {
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+  void* memory = malloc(size == 0 ? 1 : size);
+  if (memory == NULL) {
+    throw std::bad_alloc();
+  }
+
+  return memory;
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+  free(memory);
+}
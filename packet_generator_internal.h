@@ -0,0 +1,179 @@
+// Internals of the packet generator which the arithmetic_test program, the
+// tests and the benchmark use on top of the library interface
+// (packet_generator.h): the --stats counters and timers, the random number
+// streams, and the problem pools and page templates. Other users of the
+// library do not need these, and they may change with any version.
+
+#ifndef PACKET_GENERATOR_INTERNAL_H_
+#define PACKET_GENERATOR_INTERNAL_H_
+
+#include "packet_generator.h"
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace packet_generator {
+
+// xoshiro256** pseudorandom number generator (see http://prng.di.unimi.it/),
+// usable with the standard library algorithms. Each test of a packet gets a
+// stream of its own, seeded directly from the packet seed and the test number,
+// so tests can be shuffled independently of each other and in any order.
+class Xoshiro256 {
+ public:
+  typedef uint64_t result_type;
+
+  // Seed the state with SplitMix64 output (as recommended by the authors)
+  explicit Xoshiro256(uint64_t seed);
+
+  // Seed the state of stream number stream of the seed; every pair of seed
+  // and stream has a state of its own, so any stream can be set up directly
+  Xoshiro256(uint64_t seed, uint64_t stream);
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT64_MAX; }
+  result_type operator()();
+
+ private:
+  uint64_t state_[4];
+};
+
+// Random number streams of a packet: test n (0-based) uses stream n of the
+// packet seed, and the passes through the decks of a packet without repeats
+// use streams from kDeckStreams on (see ShuffleDeck)
+const uint64_t kDeckStreams = 1ULL << 63;
+
+// Timings (in nanoseconds, summed over all threads) and counters collected with
+// --stats
+struct Stats {
+  enum Phase {
+    kParse,    // Command line (and manifest) parsing
+    kSetup,    // Digit table and page template setup
+    kShuffle,  // Shuffling the test pages
+    kRender,   // Score tracker, solutions page and test pages
+    kWrite,    // Writes to the output file (including closing it)
+    kNumPhases
+  };
+
+  std::atomic<uint64_t> phase_time[kNumPhases];
+  std::atomic<uint64_t> bytes_written;
+  std::atomic<uint64_t> num_flushes;
+};
+
+// Statistics collected by packet generation, or NULL (the default) to collect
+// none, so that the instrumentation costs no more than a pointer check when it
+// is off. Set this before generating packets, not while they are generated.
+extern Stats* stats;
+
+// Adds the time until the end of the scope to a phase of stats (if enabled)
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(Stats::Phase phase) : phase_(phase) {
+    if (stats != NULL) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~ScopedTimer() {
+    if (stats != NULL) {
+      stats->phase_time[phase_].fetch_add(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_).count(),
+          std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  Stats::Phase phase_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Pool of problems of a test, stored as a structure of arrays: problem k is
+// first[k] (augend/multiplier/minuend/dividend) and second[k]
+// (addend/multiplicand/subtrahend/divisor), and its answer is answer[k]. The
+// operands are stored as compact 16-bit values so that shuffling and rendering
+// large pools stay within cache; the answers are computed once, when the pool
+// is built, and move along with the operands.
+struct ProblemSet {
+  size_t size() const { return first.size(); }
+
+  std::vector<int16_t> first;
+  std::vector<int16_t> second;
+  std::vector<int32_t> answer;
+};
+
+// Precomputed LaTeX source of a test page without solutions. Every test page
+// of a packet has the same markup and only the operands change, so the static
+// skeleton is rendered once and the operands are patched into a copy of it for
+// each page. Operand slots are fixed-width and right-aligned with spaces, which
+// LaTeX ignores inside of the table cells.
+struct PageTemplate {
+  // Slot positions of the operands of one problem within skeleton
+  struct Slots {
+    size_t first;
+    size_t second;
+  };
+
+  std::string skeleton;
+  std::vector<Slots> slots;  // One per problem, in page order
+  int first_width;
+  int second_width;
+};
+
+// Problem pool and test page templates for an operation, pair of operand
+// ranges and number of problems per test. These only depend on those, so they
+// are set up once (on first use) and then shared by all packets and threads.
+struct ProblemSetup {
+  template <typename Op>
+  ProblemSetup(OperandRange first_range, OperandRange second_range,
+               size_t problems_per_test, Op);
+
+  // problems_per_test is at most the pool size (0 for the whole pool)
+  template <typename Op>
+  static const ProblemSetup& Get(OperandRange first_range,
+                                 OperandRange second_range,
+                                 size_t problems_per_test);
+  static const ProblemSetup& Get(Operation operation,
+                                 OperandRange first_range,
+                                 OperandRange second_range,
+                                 size_t problems_per_test);
+
+  // Set up a new instance which is not shared (the caller deletes it), e.g. to
+  // measure the setup
+  static ProblemSetup* Create(Operation operation, OperandRange first_range,
+                              OperandRange second_range,
+                              size_t problems_per_test);
+
+  // Number of test pages per test and bytes of all pages of one test
+  size_t num_pages() const;
+  size_t test_size() const;
+
+  // The operation (see the operation traits in packet_generator.cpp), for
+  // the parts of packets which are not templated on it
+  char name;
+  const char* pdf_glyph;
+  void (*make_test_page)(OutputBuffer& output_file, const ProblemSet& problems,
+                         size_t begin, size_t end, bool include_solutions);
+
+  ProblemSet problems;
+  size_t problems_per_test;
+
+  // All pages of a test but the last are full pages
+  PageTemplate full_page;
+  PageTemplate last_page;
+};
+
+// Fisher-Yates shuffle of the problems of a pool
+void ShuffleProblems(ProblemSet* problems, Xoshiro256& rng);
+
+// Write a test page with the operands first[k] and second[k] to page, which
+// holds page_template.skeleton.size() bytes
+void RenderTestPage(char* page, const PageTemplate& page_template,
+                    const int16_t* first, const int16_t* second);
+
+}  // namespace packet_generator
+
+#endif  // PACKET_GENERATOR_INTERNAL_H_
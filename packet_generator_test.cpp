@@ -0,0 +1,1030 @@
+// Tests of the packet generator and the arithmetic_test program:
+//
+//   packet_generator_test program testdata [--update]
+//
+// The packets of the library are checked in-process: the answer keys must hold
+// valid problems of the pool, the score tracker and pages must be there for
+// every test, the tests must differ, the operations of a mix must have their
+// share of the tests, and none of it may depend on the number of threads.
+// Then program (the arithmetic_test program) creates fixed-seed packets in
+// every output mode (LaTeX and PDF, -k, --no-repeat, -r, mixes, --tests, CSV
+// answer keys, --mmap, --gzip, --cache-dir, the standard output, -j,
+// manifests and the server), which must match the golden files in testdata
+// byte for byte. A packet which does not is kept, with the first difference
+// and a diff command printed. --update rewrites the golden files from the
+// program's output instead, for a deliberate change of the output.
+
+#include "packet_generator.h"
+#include "packet_generator_internal.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <map>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ftw.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+using packet_generator::AnswerKeyHeader;
+using packet_generator::AnswerKeyRecord;
+using packet_generator::AnswerKeyTest;
+using packet_generator::OperandRange;
+using packet_generator::Operation;
+using packet_generator::OperationWeight;
+using packet_generator::OutputBuffer;
+using packet_generator::OutputOptions;
+using packet_generator::PacketGenerator;
+using packet_generator::PacketRequest;
+using packet_generator::Xoshiro256;
+using packet_generator::kAddition;
+using packet_generator::kBinaryAnswerKey;
+using packet_generator::kDeckStreams;
+using packet_generator::kDivision;
+using packet_generator::kLatexOutput;
+using packet_generator::kMultiplication;
+using packet_generator::kPdfOutput;
+using packet_generator::kSubtraction;
+
+// Problems of a pool, by operands: the answer and the number of copies
+typedef std::map<std::pair<int, int>, std::pair<int, size_t> > Pool;
+
+// A run of the program whose output files must match golden files. In
+// arguments (separated by spaces), {out} stands for the output file of the
+// run in the temporary directory (without extension) and {dir} for the
+// temporary directory. The files compared are given by extension: "ext" is
+// {out}.ext against testdata/golden.ext, "ext=golden_ext" compares {out}.ext
+// against testdata/golden.golden_ext instead. The standard output of the run
+// goes to {out}.stdout ({out}.stdout.gz if that is compared), and ".gz" files
+// are decompressed before they are compared.
+struct ProgramCase {
+  const char* name;
+  const char* arguments;
+  const char* files;
+  const char* golden;  // NULL for name
+  int runs;            // Times the program is run (the last run is compared)
+};
+
+// Golden runs of the program: each output mode of a packet is compared with
+// the golden files of the same packet created without it
+const ProgramCase kProgramCases[] = {
+  {"add", "-t a -n 3 -S 1 --answer-key=csv -o {out}", "tex csv", NULL, 1},
+  {"mul_pdf", "-t m -n 3 -S 2 -f pdf -o {out}", "pdf", NULL, 1},
+  {"sub_k", "-t s -n 3 -S 3 -k 50 --answer-key=csv -o {out}", "tex csv", NULL,
+   1},
+  {"div_no_repeat", "-t d -n 3 -S 4 -k 50 --no-repeat --answer-key=csv "
+   "-o {out}", "tex csv", NULL, 1},
+  {"ranges", "-t m -r 10-20,3-5 -n 2 -S 5 --answer-key=csv -o {out}",
+   "tex csv", NULL, 1},
+  {"mix", "-t a3m1s2d2 -n 8 -S 6 --answer-key=csv -o {out}", "tex csv", NULL,
+   1},
+  {"mix_pdf", "-t ms -n 3 -S 7 -k 30 -f pdf --answer-key=csv -o {out}",
+   "pdf csv", NULL, 1},
+  {"selection", "-t a -n 60 -S 1 --tests 2-3 --answer-key=csv -o {out}",
+   "tex csv", NULL, 1},
+  {"add_j4", "-t a -n 3 -S 1 --answer-key=csv -j 4 -o {out}", "tex csv",
+   "add", 1},
+  {"add_mmap", "-t a -n 3 -S 1 --answer-key=csv --mmap -o {out}", "tex csv",
+   "add", 1},
+  {"add_gzip", "-t a -n 3 -S 1 --answer-key=csv --gzip -o {out}",
+   "tex.gz=tex csv", "add", 1},
+  {"add_cache", "-t a -n 3 -S 1 --answer-key=csv --cache-dir {dir}/cache "
+   "-o {out}", "tex csv", "add", 2},
+  {"add_stdout", "-t a -n 3 -S 1 -o -", "stdout=tex", "add", 1},
+  {"add_pipe", "-t a -n 3 -S 1 --pipe", "stdout=tex", "add", 1},
+  {"add_gzip_stdout", "-t a -n 3 -S 1 --gzip -o -", "stdout.gz=tex", "add",
+   1},
+  {"mul_pdf_j4", "-t m -n 3 -S 2 -f pdf -j 4 -o {out}", "pdf", "mul_pdf", 1},
+  {"mul_pdf_mmap", "-t m -n 3 -S 2 -f pdf --mmap -o {out}", "pdf", "mul_pdf",
+   1},
+  {"sub_k_j4", "-t s -n 3 -S 3 -k 50 --answer-key=csv -j 4 -o {out}",
+   "tex csv", "sub_k", 1},
+};
+
+// Packets of a manifest, created with -b (and -j 2); each line has a seed of
+// its own, since derived seeds depend on the output file names
+const char* const kManifestPackets[][2] = {
+  {"batch_add", "a 3 1"},
+  {"batch_div", "d 2 8"},
+};
+
+// Server requests and the golden file of the reply (the same packets as
+// created by the program), or NULL if the reply must be an error line
+const char* const kServerRequests[][2] = {
+  {"a 3 1", "add.tex"},
+  {"m 3 2 pdf", "mul_pdf.pdf"},
+  {"a 60 1 tex 2-3", "selection.tex"},
+  {"q", NULL},
+};
+
+// Prototypes
+bool CheckOperationPackets(char name, Operation operation);
+
+bool CheckMixedPacket();
+
+bool CheckRandomStreams();
+
+std::string CreatePacket(const PacketRequest& packet, OutputOptions options,
+                         int num_threads, std::string* key);
+
+Pool PoolOf(char operation, OperandRange range);
+
+std::string CheckAnswerKey(const std::string& key, char operation,
+                           int num_tests, const Pool& pool,
+                           size_t problems_per_test, bool no_repeat);
+
+std::string CheckTestsDiffer(const std::string& key, int num_tests,
+                             size_t problems_per_test);
+
+bool CorrectAnswer(char operation, int first, int second, int answer);
+
+size_t CountOccurrences(const std::string& text, const char* pattern);
+
+bool CheckProgramCase(const std::string& program, const std::string& testdata,
+                      const std::string& dir, const ProgramCase& test_case,
+                      bool update);
+
+bool CheckManifest(const std::string& program, const std::string& testdata,
+                   const std::string& dir, bool update);
+
+bool CheckServer(const std::string& program, const std::string& testdata,
+                 const std::string& dir);
+
+bool CompareWithGolden(const std::string& actual_file,
+                       const std::string& golden_file, bool gzipped,
+                       bool update, std::string* failure);
+
+int RunProgram(const std::string& program,
+               const std::vector<std::string>& arguments,
+               const std::string& stdout_file);
+
+pid_t StartProgram(const std::string& program,
+                   const std::vector<std::string>& arguments);
+
+std::vector<std::string> SplitArguments(std::string arguments,
+                                        const std::string& out,
+                                        const std::string& dir);
+
+bool ReadFile(const std::string& file, std::string* data);
+
+bool ReadGzipFile(const std::string& file, std::string* data);
+
+bool WriteFile(const std::string& file, const std::string& data);
+
+std::string Replace(std::string text, const std::string& from,
+                    const std::string& to);
+
+void PrintResult(const std::string& name, const std::string& failure);
+
+int main(int argc, char* argv[]) {
+  if (argc < 3 || argc > 4 ||
+      (argc == 4 && strcmp(argv[3], "--update") != 0)) {
+    std::cerr << "usage: " << argv[0] << " program testdata [--update]";
+    std::cerr << std::endl;
+
+    return 1;
+  }
+  const std::string program = argv[1];
+  const std::string testdata = argv[2];
+  const bool update = argc == 4;
+  signal(SIGPIPE, SIG_IGN);
+
+  bool passed = true;
+  if (!update) {
+    std::cout << "Packets of each test type (answer keys, tracker, pages, ";
+    std::cout << "-j 1 = -j 4,\ntests differ, mix by weight):\n";
+    passed &= CheckOperationPackets('a', kAddition);
+    passed &= CheckOperationPackets('m', kMultiplication);
+    passed &= CheckOperationPackets('s', kSubtraction);
+    passed &= CheckOperationPackets('d', kDivision);
+    passed &= CheckMixedPacket();
+
+    // Tests are only independent of each other if their streams are
+    bool independent = CheckRandomStreams();
+    PrintResult("streams", independent ? "" :
+                "the first outputs of test and deck streams repeat");
+    passed &= independent;
+  }
+
+  char dir_template[] = "/tmp/packet_generator_test.XXXXXX";
+  if (mkdtemp(dir_template) == NULL) {
+    std::cerr << "Error: unable to create a temporary directory." << std::endl;
+
+    return 1;
+  }
+  const std::string dir = dir_template;
+
+  std::cout << "\nPackets of " << program << " against the golden files of ";
+  std::cout << testdata << ":\n";
+  const size_t kNumCases = sizeof(kProgramCases) / sizeof(kProgramCases[0]);
+  for (size_t c = 0; c < kNumCases; c++) {
+    passed &= CheckProgramCase(program, testdata, dir, kProgramCases[c],
+                               update);
+  }
+  passed &= CheckManifest(program, testdata, dir, update);
+  if (!update) {
+    passed &= CheckServer(program, testdata, dir);
+  }
+
+  // The output of failed cases is kept for a look at the differences
+  if (passed) {
+    struct Remover {
+      static int Remove(const char* path, const struct stat*, int,
+                        struct FTW*) {
+        return remove(path);
+      }
+    };
+    nftw(dir.c_str(), Remover::Remove, 16, FTW_DEPTH | FTW_PHYS);
+  } else {
+    std::cerr << "Error: tests failed; their output is in " << dir << ".";
+    std::cerr << std::endl;
+  }
+
+  return passed ? 0 : 1;
+}
+
+// Check fixed-seed packets of 61 tests of the operation (so that the tracker
+// spills onto a second page), as LaTeX and PDF, with every problem of the pool
+// per test, with -k 50 and with -k 50 --no-repeat: the binary answer key must
+// hold valid problems of the pool (every problem once without -k) which differ
+// between the tests, the packet must have a tracker line and a page per test,
+// and neither may depend on the number of threads. Prints the first failed
+// check; returns false if one failed.
+bool CheckOperationPackets(char name, Operation operation) {
+  const int kNumModes = 3;
+  const int kTests = 61;
+  const int kTrackerLines = 60;
+  const OperandRange kRange = {0, 9};
+
+  const Pool pool = PoolOf(name, kRange);
+  size_t pool_size = 0;
+  for (Pool::const_iterator problem = pool.begin(); problem != pool.end();
+       ++problem) {
+    pool_size += problem->second.second;
+  }
+
+  std::string failure;
+  for (int check = 0; check < 2 * kNumModes && failure.empty(); check++) {
+    const int mode = check % kNumModes;
+    const bool pdf = check >= kNumModes;
+    PacketRequest packet;
+    packet.operation = operation;
+    packet.first_range = kRange;
+    packet.second_range = kRange;
+    packet.problems_per_test = mode == 0 ? 0 : 50;
+    packet.no_repeat = mode == 2;
+    packet.unique = false;
+    packet.first_test = 0;
+    packet.num_selected = 0;
+    packet.results = NULL;
+    packet.num_tests = kTests;
+    packet.seed = 27 + mode;
+    OutputOptions options;
+    options.format = pdf ? kPdfOutput : kLatexOutput;
+    options.answer_key = kBinaryAnswerKey;
+
+    std::string keys[2];
+    std::string outputs[2] = {CreatePacket(packet, options, 1, &keys[0]),
+                              CreatePacket(packet, options, 4, &keys[1])};
+
+    const char* const kModeNames[kNumModes] = {"", " -k 50",
+                                               " -k 50 --no-repeat"};
+    std::string label = std::string(pdf ? "pdf" : "tex") + kModeNames[mode];
+    size_t problems_per_test = mode == 0 ? pool_size : 50;
+    std::string key_error = CheckAnswerKey(keys[0], name, kTests, pool,
+                                           mode == 0 ? 0 : problems_per_test,
+                                           packet.no_repeat);
+    if (key_error.empty()) {
+      key_error = CheckTestsDiffer(keys[0], kTests, problems_per_test);
+    }
+    size_t tracker_lines = CountOccurrences(outputs[0], pdf ? ". Time:)" :
+                                                              ". Time: ");
+
+    // Pages: a test page per test, plus the tracker and solutions pages
+    size_t test_pages = pdf ?
+        CountOccurrences(outputs[0], "/Type /Page") -
+        CountOccurrences(outputs[0], "/Type /Pages") -
+        (kTests + kTrackerLines - 1) / kTrackerLines - 1 :
+        CountOccurrences(outputs[0], "\\begin{tabular}") - 1;
+    if (outputs[0] != outputs[1] || keys[0] != keys[1]) {
+      failure = label + ": -j 4 differs from -j 1";
+    } else if (!key_error.empty()) {
+      failure = label + ": " + key_error;
+    } else if (tracker_lines != static_cast<size_t>(kTests)) {
+      failure = label + ": the tracker does not have a line per test";
+    } else if (test_pages != static_cast<size_t>(kTests)) {
+      failure = label + ": there is not a page per test";
+    }
+  }
+
+  PrintResult(std::string(1, name), failure);
+
+  return failure.empty();
+}
+
+// Check a fixed-seed mixed packet of 4000 tests of all four operations,
+// weighted 3:1:2:2, like CheckOperationPackets: it must not depend on the
+// number of threads, every problem must be correct, the tests must differ, and
+// each operation must have its share of the tests by weight (within a fifth
+// of it). Returns false if a check failed.
+bool CheckMixedPacket() {
+  const int kTests = 4000;
+  const OperandRange kRange = {0, 9};
+  const OperationWeight kMix[] = {{kAddition, 3}, {kMultiplication, 1},
+                                  {kSubtraction, 2}, {kDivision, 2}};
+  const char kNames[] = "amsd";
+  const int kNumParts = 4;
+  const int kTotalWeight = 8;
+
+  PacketRequest packet;
+  packet.operation = kAddition;
+  packet.mix.assign(kMix, kMix + kNumParts);
+  packet.first_range = kRange;
+  packet.second_range = kRange;
+  packet.problems_per_test = 0;
+  packet.no_repeat = false;
+  packet.unique = false;
+  packet.first_test = 0;
+  packet.num_selected = 0;
+  packet.results = NULL;
+  packet.num_tests = kTests;
+  packet.seed = 27;
+  OutputOptions options;
+  options.format = kLatexOutput;
+  options.answer_key = kBinaryAnswerKey;
+
+  std::string keys[2];
+  std::string outputs[2] = {CreatePacket(packet, options, 1, &keys[0]),
+                            CreatePacket(packet, options, 4, &keys[1])};
+
+  // The version 2 key: the operation and problems of each test, then the
+  // records of every test
+  std::string failure;
+  const std::string& key = keys[0];
+  AnswerKeyHeader header;
+  const size_t tests_offset = sizeof(header);
+  const size_t records_offset = tests_offset + kTests * sizeof(AnswerKeyTest);
+  std::vector<AnswerKeyTest> tests(kTests);
+  int part_tests[kNumParts] = {0, 0, 0, 0};
+  size_t num_records = 0;
+  if (key.size() >= records_offset) {
+    memcpy(&header, key.data(), sizeof(header));
+    memcpy(&tests[0], key.data() + tests_offset,
+           kTests * sizeof(AnswerKeyTest));
+    for (int test = 0; test < kTests; test++) {
+      const char* part = strchr(kNames, tests[test].operation);
+      if (part != NULL && *part != '\0') {
+        part_tests[part - kNames]++;
+      }
+      num_records += tests[test].problems_per_test;
+    }
+  }
+  if (outputs[0] != outputs[1] || keys[0] != keys[1]) {
+    failure = "-j 4 differs from -j 1";
+  } else if (key.size() != records_offset +
+                           num_records * sizeof(AnswerKeyRecord) ||
+             memcmp(header.magic, "ATKY", 4) != 0 || header.version != 2 ||
+             header.num_tests != static_cast<uint32_t>(kTests)) {
+    failure = "the answer key is wrong";
+  }
+
+  // Every problem must be correct, and the problems at each position of the
+  // tests of an operation must differ between the tests
+  for (int part = 0; part < kNumParts && failure.empty(); part++) {
+    std::string part_records;
+    size_t problems_per_test = 0;
+    const char* records = key.data() + records_offset;
+    for (int test = 0; test < kTests && failure.empty(); test++) {
+      size_t num_problems = tests[test].problems_per_test;
+      if (tests[test].operation == kNames[part]) {
+        for (size_t k = 0; k < num_problems; k++) {
+          AnswerKeyRecord record;
+          memcpy(&record, records + k * sizeof(record), sizeof(record));
+          if (!CorrectAnswer(kNames[part], record.first, record.second,
+                             record.answer)) {
+            failure = "a problem has a wrong answer";
+          }
+        }
+        part_records.append(records, num_problems * sizeof(AnswerKeyRecord));
+        problems_per_test = num_problems;
+      }
+      records += num_problems * sizeof(AnswerKeyRecord);
+    }
+
+    // The tests of the operation as a version 1 key
+    AnswerKeyHeader part_header = header;
+    part_header.version = 1;
+    std::string part_key(reinterpret_cast<const char*>(&part_header),
+                         sizeof(part_header));
+    part_key += part_records;
+    std::string differ_error = CheckTestsDiffer(part_key, part_tests[part],
+                                                problems_per_test);
+    int expected = kTests * kMix[part].weight / kTotalWeight;
+    if (failure.empty() && !differ_error.empty()) {
+      failure = std::string(1, kNames[part]) + ": " + differ_error;
+    } else if (failure.empty() &&
+               std::abs(part_tests[part] - expected) > expected / 5) {
+      std::ostringstream message;
+      message << part_tests[part] << " tests of " << kNames[part];
+      message << " instead of about " << expected;
+      failure = message.str();
+    }
+  }
+
+  PrintResult("mix", failure);
+
+  return failure.empty();
+}
+
+// Check that the streams of a seed are independent from their first output on:
+// the first outputs of the first kStreams test streams and of as many deck
+// streams must all differ, as 64-bit random numbers practically always do
+bool CheckRandomStreams() {
+  const uint64_t kStreams = 1 << 16;
+  const uint64_t kSeed = 27;
+
+  std::vector<uint64_t> first_outputs;
+  for (uint64_t stream = 0; stream < kStreams; stream++) {
+    Xoshiro256 test_rng(kSeed, stream);
+    Xoshiro256 deck_rng(kSeed, kDeckStreams + stream);
+    first_outputs.push_back(test_rng());
+    first_outputs.push_back(deck_rng());
+  }
+  std::sort(first_outputs.begin(), first_outputs.end());
+
+  return std::adjacent_find(first_outputs.begin(), first_outputs.end()) ==
+         first_outputs.end();
+}
+
+// Create a packet in memory with num_threads threads; returns it, and its
+// answer key in key
+std::string CreatePacket(const PacketRequest& packet, OutputOptions options,
+                         int num_threads, std::string* key) {
+  options.buffer_size = 1 << 20;
+  options.num_threads = num_threads;
+  options.pipe = false;
+  options.mmap = false;
+  options.gzip_level = 0;
+  options.fingerprints = NULL;
+
+  std::ostringstream packet_out;
+  std::ostringstream key_out;
+  {
+    OutputBuffer output(packet_out, options.buffer_size);
+    OutputBuffer key_output(key_out, options.buffer_size);
+    PacketGenerator generator(options);
+    if (!generator.Generate(packet, output, &key_output)) {
+      std::cerr << "Error: " << generator.error() << "." << std::endl;
+    }
+  }
+  *key = key_out.str();
+
+  return packet_out.str();
+}
+
+// Problem pool of the operation ('a', 'm', 's' or 'd') over range for both
+// operands, worked out independently of the generator: the operands of
+// subtraction are ordered so that answers are non-negative (which repeats
+// problems), and division has the dividend, divisor (not 0) and quotient
+Pool PoolOf(char operation, OperandRange range) {
+  Pool pool;
+  for (int i = range.low; i <= range.high; i++) {
+    for (int j = range.low; j <= range.high; j++) {
+      std::pair<int, int> operands(i, j);
+      int answer = operation == 'a' ? i + j : i * j;
+      if (operation == 's') {
+        operands = std::make_pair(std::max(i, j), std::min(i, j));
+        answer = operands.first - operands.second;
+      } else if (operation == 'd') {
+        if (i == 0) {
+          continue;
+        }
+        operands = std::make_pair(i * j, i);
+        answer = j;
+      }
+      std::pair<int, size_t>& problem = pool[operands];
+      problem.first = answer;
+      problem.second++;
+    }
+  }
+
+  return pool;
+}
+
+// Check a binary answer key of num_tests tests of the operation: every problem
+// must be correct, non-negative and one of the pool, with every problem of the
+// pool exactly once per test if problems_per_test is 0, and at most as often
+// as in the pool per test otherwise, or per pass through the pool with
+// no_repeat (a test may then straddle two passes). Returns an error message,
+// or an empty string if the key is valid.
+std::string CheckAnswerKey(const std::string& key, char operation,
+                           int num_tests, const Pool& pool,
+                           size_t problems_per_test, bool no_repeat) {
+  size_t pool_size = 0;
+  Pool::const_iterator problem;
+  for (problem = pool.begin(); problem != pool.end(); ++problem) {
+    pool_size += problem->second.second;
+  }
+  const bool whole_pool = problems_per_test == 0;
+  if (whole_pool) {
+    problems_per_test = pool_size;
+  }
+
+  AnswerKeyHeader header;
+  if (key.size() != sizeof(header) + num_tests * problems_per_test *
+                    sizeof(AnswerKeyRecord)) {
+    return "the answer key has the wrong size";
+  }
+  memcpy(&header, key.data(), sizeof(header));
+  if (memcmp(header.magic, "ATKY", 4) != 0 || header.version != 1 ||
+      header.operation != operation ||
+      header.num_tests != static_cast<uint32_t>(num_tests) ||
+      header.problems_per_test != problems_per_test) {
+    return "the answer key header is wrong";
+  }
+
+  // Problems are counted per test, or per pass through the pool
+  const size_t count_span = no_repeat ? pool_size : problems_per_test;
+  const char* records = key.data() + sizeof(header);
+  std::map<std::pair<int, int>, size_t> counts;
+  for (int test = 0; test < num_tests; test++) {
+    for (size_t k = 0; k < problems_per_test; k++) {
+      if ((test * problems_per_test + k) % count_span == 0) {
+        counts.clear();
+      }
+
+      AnswerKeyRecord record;
+      memcpy(&record, records, sizeof(record));
+      records += sizeof(record);
+
+      int first = record.first;
+      int second = record.second;
+      int answer = record.answer;
+      if (!CorrectAnswer(operation, first, second, answer) || answer < 0) {
+        return "a problem has a wrong or negative answer";
+      }
+
+      std::pair<int, int> operands(first, second);
+      problem = pool.find(operands);
+      if (problem == pool.end() || problem->second.first != answer) {
+        return "a problem is not in the pool";
+      }
+      if (++counts[operands] > problem->second.second) {
+        return no_repeat ? "a problem repeats within a pass" :
+                           "a problem repeats within a test";
+      }
+    }
+    if (whole_pool && counts.size() != pool.size()) {
+      return "a test does not have every problem of the pool";
+    }
+  }
+
+  return std::string();
+}
+
+// Check that the tests of a binary answer key (version 1) differ from each
+// other at every position: the problems at a position must take at least a
+// quarter as many different values as there are tests or problems per test,
+// whichever is fewer, as the problems of independently shuffled tests do by
+// far (some 45 values over 61 tests for a pool of 100). Returns an error
+// message, or an empty string if they do.
+std::string CheckTestsDiffer(const std::string& key, int num_tests,
+                             size_t problems_per_test) {
+  const char* records = key.data() + sizeof(AnswerKeyHeader);
+  for (size_t k = 0; k < problems_per_test; k++) {
+    std::vector<std::pair<int, int> > problems;
+    for (int test = 0; test < num_tests; test++) {
+      AnswerKeyRecord record;
+      memcpy(&record, records + (test * problems_per_test + k) *
+                      sizeof(record), sizeof(record));
+      problems.push_back(std::make_pair(record.first, record.second));
+    }
+    std::sort(problems.begin(), problems.end());
+    int num_values = std::unique(problems.begin(), problems.end()) -
+                     problems.begin();
+    if (num_values < std::min<int>(num_tests, problems_per_test) / 4) {
+      std::ostringstream message;
+      message << "problem " << k + 1 << " differs in " << num_values;
+      message << " ways over " << num_tests << " tests";
+
+      return message.str();
+    }
+  }
+
+  return std::string();
+}
+
+// Whether answer is the answer of the problem of the operation ('a', 'm', 's'
+// or 'd')
+bool CorrectAnswer(char operation, int first, int second, int answer) {
+  return operation == 'a' ? answer == first + second :
+         operation == 'm' ? answer == first * second :
+         operation == 's' ? answer == first - second :
+                            second != 0 && first == answer * second;
+}
+
+// Number of (non-overlapping) occurrences of pattern in text
+size_t CountOccurrences(const std::string& text, const char* pattern) {
+  size_t count = 0;
+  const size_t length = strlen(pattern);
+  for (size_t found = text.find(pattern); found != std::string::npos;
+       found = text.find(pattern, found + length)) {
+    count++;
+  }
+
+  return count;
+}
+
+// Run the program for a golden case (see ProgramCase) in dir and compare its
+// files with the golden files in testdata (or replace them with update).
+// Prints the result; returns false if the program failed or a file differs.
+bool CheckProgramCase(const std::string& program, const std::string& testdata,
+                      const std::string& dir, const ProgramCase& test_case,
+                      bool update) {
+  const std::string out = dir + "/" + test_case.name;
+  const std::string golden = testdata + "/" +
+      (test_case.golden != NULL ? test_case.golden : test_case.name);
+  const std::vector<std::string> arguments =
+      SplitArguments(test_case.arguments, out, dir);
+
+  const std::string stdout_file = out + (strstr(test_case.files, "stdout.gz") ?
+                                         ".stdout.gz" : ".stdout");
+  std::string failure;
+  for (int run = 0; run < test_case.runs && failure.empty(); run++) {
+    int status = RunProgram(program, arguments, stdout_file);
+    if (status != 0) {
+      std::ostringstream message;
+      message << "the program exited with status " << status;
+      failure = message.str();
+    }
+  }
+
+  // Only the cases with golden files of their own update them
+  const bool update_golden = update && test_case.golden == NULL;
+  std::istringstream files(test_case.files);
+  std::string file;
+  while (failure.empty() && files >> file) {
+    std::string extension = file;
+    std::string golden_extension = file;
+    size_t equals = file.find('=');
+    if (equals != std::string::npos) {
+      extension = file.substr(0, equals);
+      golden_extension = file.substr(equals + 1);
+    }
+    const bool gzipped = extension.size() > 3 &&
+        extension.compare(extension.size() - 3, 3, ".gz") == 0;
+    CompareWithGolden(out + "." + extension, golden + "." + golden_extension,
+                      gzipped, update_golden, &failure);
+  }
+
+  if (!update || update_golden || !failure.empty()) {
+    PrintResult(test_case.name, failure);
+  }
+
+  return failure.empty();
+}
+
+// Create the packets of kManifestPackets with -b, in two threads, and compare
+// them with their golden files (or replace those with update)
+bool CheckManifest(const std::string& program, const std::string& testdata,
+                   const std::string& dir, bool update) {
+  const size_t kNumPackets = sizeof(kManifestPackets) /
+                             sizeof(kManifestPackets[0]);
+  const std::string manifest_file = dir + "/manifest";
+  std::string manifest = "# Packets of the manifest test\n";
+  for (size_t p = 0; p < kNumPackets; p++) {
+    manifest += dir + "/" + kManifestPackets[p][0] + " " +
+                kManifestPackets[p][1] + "\n";
+  }
+
+  std::string failure;
+  if (!WriteFile(manifest_file, manifest)) {
+    failure = "unable to write " + manifest_file;
+  } else {
+    std::vector<std::string> arguments;
+    arguments.push_back("-b");
+    arguments.push_back(manifest_file);
+    arguments.push_back("-j");
+    arguments.push_back("2");
+    int status = RunProgram(program, arguments, dir + "/manifest.stdout");
+    if (status != 0) {
+      std::ostringstream message;
+      message << "the program exited with status " << status;
+      failure = message.str();
+    }
+  }
+  for (size_t p = 0; p < kNumPackets && failure.empty(); p++) {
+    const std::string name = kManifestPackets[p][0];
+    CompareWithGolden(dir + "/" + name + ".tex", testdata + "/" + name + ".tex",
+                      false, update, &failure);
+  }
+  PrintResult("manifest", failure);
+
+  return failure.empty();
+}
+
+// Start the program as a server in dir, send it each request of
+// kServerRequests on a connection of its own and compare the replies with
+// their golden files, then stop it with SIGTERM, after which it must exit with
+// status 0 and have removed its socket. Prints the result; returns false if a
+// check failed.
+bool CheckServer(const std::string& program, const std::string& testdata,
+                 const std::string& dir) {
+  const int kStartAttempts = 500;  // 10 ms apart
+  const std::string socket_path = dir + "/server.sock";
+  std::vector<std::string> arguments;
+  arguments.push_back("--server");
+  arguments.push_back(socket_path);
+  arguments.push_back("-j");
+  arguments.push_back("2");
+  pid_t server = StartProgram(program, arguments);
+  if (server < 0) {
+    PrintResult("server", "unable to start the program");
+
+    return false;
+  }
+
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+  std::string failure;
+  const size_t kNumRequests = sizeof(kServerRequests) /
+                              sizeof(kServerRequests[0]);
+  for (size_t r = 0; r < kNumRequests && failure.empty(); r++) {
+    // The server may still be starting up for the first request
+    int fd = -1;
+    for (int attempt = 0; fd < 0 && attempt < kStartAttempts; attempt++) {
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (connect(fd, reinterpret_cast<sockaddr*>(&address),
+                  sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+        usleep(10000);
+      }
+    }
+    if (fd < 0) {
+      failure = "unable to connect to the server";
+      break;
+    }
+
+    std::string request = std::string(kServerRequests[r][0]) + "\n";
+    std::string reply;
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(request.size())) {
+      failure = "unable to send request '" + request + "'";
+    }
+    char data[65536];
+    ssize_t length;
+    while (failure.empty() && (length = recv(fd, data, sizeof(data), 0)) != 0) {
+      if (length < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        failure = "unable to receive the reply";
+        break;
+      }
+      reply.append(data, length);
+    }
+    close(fd);
+
+    const std::string reply_file = dir + "/server_reply_" +
+                                   std::string(1, static_cast<char>('1' + r));
+    if (!failure.empty()) {
+      break;
+    } else if (kServerRequests[r][1] == NULL) {
+      if (reply.compare(0, 7, "error: ") != 0 ||
+          reply.find('\n') != reply.size() - 1) {
+        WriteFile(reply_file, reply);
+        failure = "request '" + std::string(kServerRequests[r][0]) +
+                  "' did not get a single error line (see " + reply_file + ")";
+      }
+    } else if (!WriteFile(reply_file, reply)) {
+      failure = "unable to write " + reply_file;
+    } else {
+      CompareWithGolden(reply_file, testdata + "/" + kServerRequests[r][1],
+                        false, false, &failure);
+      if (!failure.empty()) {
+        failure = "request '" + std::string(kServerRequests[r][0]) + "': " +
+                  failure;
+      }
+    }
+  }
+
+  kill(server, SIGTERM);
+  int status;
+  if (waitpid(server, &status, 0) != server || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    if (failure.empty()) {
+      failure = "the server did not exit with status 0 on SIGTERM";
+    }
+  } else if (access(socket_path.c_str(), F_OK) == 0 && failure.empty()) {
+    failure = "the server did not remove its socket";
+  }
+  PrintResult("server", failure);
+
+  return failure.empty();
+}
+
+// Compare actual_file (decompressed first if gzipped) with golden_file, or
+// with update, replace golden_file with it. Sets failure to the first
+// difference (by line and byte, with the lines of both files) and a diff
+// command; returns false if they differ or a file cannot be read.
+bool CompareWithGolden(const std::string& actual_file,
+                       const std::string& golden_file, bool gzipped,
+                       bool update, std::string* failure) {
+  std::string actual;
+  if (!(gzipped ? ReadGzipFile(actual_file, &actual) :
+                  ReadFile(actual_file, &actual))) {
+    *failure = "unable to read " + actual_file;
+
+    return false;
+  }
+  if (update) {
+    if (!WriteFile(golden_file, actual)) {
+      *failure = "unable to write " + golden_file;
+
+      return false;
+    }
+
+    return true;
+  }
+
+  std::string golden;
+  if (!ReadFile(golden_file, &golden)) {
+    *failure = "unable to read " + golden_file + " (create it with --update)";
+
+    return false;
+  }
+  if (actual == golden) {
+    return true;
+  }
+
+  // Compressed output is compared as its decompressed data, which is kept
+  std::string compared_file = actual_file;
+  if (gzipped) {
+    compared_file = actual_file.substr(0, actual_file.size() - 3);
+    WriteFile(compared_file, actual);
+  }
+
+  size_t offset = 0;
+  while (offset < actual.size() && offset < golden.size() &&
+         actual[offset] == golden[offset]) {
+    offset++;
+  }
+  const size_t line_start = golden.rfind('\n', offset == 0 ? 0 : offset - 1);
+  const size_t begin = line_start == std::string::npos || offset == 0 ? 0 :
+                       line_start + 1;
+  const int line = static_cast<int>(std::count(golden.begin(),
+                                               golden.begin() + begin, '\n'));
+  // Up to kShownLength bytes of the line, from a little before the difference
+  const size_t kShownLength = 60;
+  const size_t shown = std::max(begin, offset < 20 ? 0 : offset - 20);
+  std::string expected_line = golden.substr(shown, kShownLength);
+  std::string actual_line = actual.substr(shown, kShownLength);
+  expected_line = expected_line.substr(0, expected_line.find('\n'));
+  actual_line = actual_line.substr(0, actual_line.find('\n'));
+
+  std::ostringstream message;
+  message << compared_file << " differs from " << golden_file << " at line ";
+  message << line + 1 << ", byte " << offset + 1 << " (sizes " << actual.size();
+  message << " and " << golden.size() << ")\n      expected: " << expected_line;
+  message << "\n      actual:   " << actual_line;
+  message << "\n      diff " << golden_file << " " << compared_file;
+  *failure = message.str();
+
+  return false;
+}
+
+// Run the program with arguments and its standard output redirected to
+// stdout_file; returns its exit status, or -1 if it could not be run
+int RunProgram(const std::string& program,
+               const std::vector<std::string>& arguments,
+               const std::string& stdout_file) {
+  int stdout_fd = open(stdout_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                       0666);
+  if (stdout_fd < 0) {
+    return -1;
+  }
+  std::cout.flush();
+  pid_t child = fork();
+  if (child == 0) {
+    dup2(stdout_fd, STDOUT_FILENO);
+    close(stdout_fd);
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(program.c_str()));
+    for (size_t a = 0; a < arguments.size(); a++) {
+      argv.push_back(const_cast<char*>(arguments[a].c_str()));
+    }
+    argv.push_back(NULL);
+    execv(program.c_str(), &argv[0]);
+    _exit(127);
+  }
+  close(stdout_fd);
+
+  int status;
+  if (child < 0 || waitpid(child, &status, 0) != child) {
+    return -1;
+  }
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Start the program with arguments in the background (with the standard
+// output of this program); returns its process ID, or -1
+pid_t StartProgram(const std::string& program,
+                   const std::vector<std::string>& arguments) {
+  std::cout.flush();
+  pid_t child = fork();
+  if (child == 0) {
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(program.c_str()));
+    for (size_t a = 0; a < arguments.size(); a++) {
+      argv.push_back(const_cast<char*>(arguments[a].c_str()));
+    }
+    argv.push_back(NULL);
+    execv(program.c_str(), &argv[0]);
+    _exit(127);
+  }
+
+  return child;
+}
+
+// The arguments of a golden case, with {out} and {dir} replaced
+std::vector<std::string> SplitArguments(std::string arguments,
+                                        const std::string& out,
+                                        const std::string& dir) {
+  std::istringstream fields(arguments);
+  std::vector<std::string> split;
+  std::string argument;
+  while (fields >> argument) {
+    split.push_back(Replace(Replace(argument, "{out}", out), "{dir}", dir));
+  }
+
+  return split;
+}
+
+bool ReadFile(const std::string& file, std::string* data) {
+  std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+  std::ostringstream contents;
+  contents << in.rdbuf();
+  *data = contents.str();
+
+  return in.good() || in.eof();
+}
+
+// Read and decompress a gzip file
+bool ReadGzipFile(const std::string& file, std::string* data) {
+  gzFile in = gzopen(file.c_str(), "rb");
+  if (in == NULL) {
+    return false;
+  }
+  data->clear();
+  char buffer[65536];
+  int length;
+  while ((length = gzread(in, buffer, sizeof(buffer))) > 0) {
+    data->append(buffer, length);
+  }
+
+  return gzclose(in) == Z_OK && length == 0;
+}
+
+bool WriteFile(const std::string& file, const std::string& data) {
+  std::ofstream out(file.c_str(), std::ios::out | std::ios::binary);
+  out << data;
+  out.close();
+
+  return out.good();
+}
+
+// text with every occurrence of from replaced by to
+std::string Replace(std::string text, const std::string& from,
+                    const std::string& to) {
+  for (size_t found = text.find(from); found != std::string::npos;
+       found = text.find(from, found + to.size())) {
+    text.replace(found, from.size(), to);
+  }
+
+  return text;
+}
+
+// Print the line of a check: its name, and ok or the failure
+void PrintResult(const std::string& name, const std::string& failure) {
+  std::cout << "  " << name << std::string(name.size() < 18 ?
+                                           18 - name.size() : 1, ' ');
+  std::cout << (failure.empty() ? "ok" : "FAILED (" + failure + ")") << "\n";
+}